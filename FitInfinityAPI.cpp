@@ -2,9 +2,266 @@
 #include <time.h>
 
 const char* FitInfinityAPI::OFFLINE_FILE = "/offline.txt";
-const char* FitInfinityAPI::OFFLINE_TEMP = "/offline.tmp";
 
-FitInfinityAPI::FitInfinityAPI(const char* baseUrl, const char* deviceId, const char* accessKey) {
+// Generates the bulkLog request body record by record from the offline store, so a
+// batch of any size is sent without ever being held in RAM
+class BulkLogStream : public Stream {
+  public:
+    static const size_t RECORD_SIZE = 128;     // largest formatted record
+    static const size_t BUFFER_SIZE = 1024;    // records are packed into this many bytes per fill
+    
+    BulkLogStream(FitInfinityOfflineStore& store, const String& head, uint32_t records, size_t length)
+        : _reader(store), _head(head), _remaining(records), _total(length), _sent(0),
+          _stage(STAGE_HEAD), _data(nullptr), _length(0), _index(0), _first(true),
+          _delivered(_reader.position()) {}
+    
+    // One record as it appears in the array, with its leading comma if it is not the first
+    static size_t formatRecord(const OfflineRecord& record, bool first, char* buffer, size_t size) {
+        char timestamp[25];
+        FitInfinityOfflineStore::formatTimestamp(record.epoch, timestamp, sizeof(timestamp));
+        
+        StaticJsonDocument<JSON_OBJECT_SIZE(3)> doc;
+        doc["type"] = FitInfinityOfflineStore::typeName(record.type);
+        doc["id"] = (const char*)record.id;
+        doc["timestamp"] = (const char*)timestamp;
+        
+        size_t length = 0;
+        if (!first) {
+            buffer[length++] = ',';
+        }
+        return length + serializeJson(doc, buffer + length, size - length);
+    }
+    
+    // Read cursor just past the last record actually sent
+    uint32_t delivered() const { return _delivered; }
+    
+    int available() {
+        if (_index >= _length && !fill()) {
+            return 0;
+        }
+        return _length - _index;
+    }
+    
+    int read() {
+        if (!available()) {
+            return -1;
+        }
+        _sent++;
+        return (uint8_t)_data[_index++];
+    }
+    
+    int peek() {
+        return available() ? (uint8_t)_data[_index] : -1;
+    }
+    
+    size_t readBytes(char* buffer, size_t length) {
+        size_t copied = 0;
+        while (copied < length && available()) {
+            size_t chunk = min(length - copied, _length - _index);
+            memcpy(buffer + copied, _data + _index, chunk);
+            _index += chunk;
+            copied += chunk;
+        }
+        _sent += copied;
+        return copied;
+    }
+    
+    size_t write(uint8_t) {
+        return 0;
+    }
+    
+  private:
+    enum Stage { STAGE_HEAD, STAGE_RECORDS, STAGE_PADDING };
+    
+    bool fill() {
+        _index = 0;
+        if (_stage == STAGE_HEAD) {
+            _data = _head.c_str();
+            _length = _head.length();
+            _stage = STAGE_RECORDS;
+            return true;
+        }
+        
+        // As many records as fit, so HTTPClient gets full writes instead of one per record
+        _data = _buffer;
+        _length = 0;
+        while (_stage == STAGE_RECORDS && BUFFER_SIZE - _length >= RECORD_SIZE) {
+            OfflineRecord record;
+            if (_remaining > 0 && _reader.next(record)) {
+                _length += formatRecord(record, _first, _buffer + _length, RECORD_SIZE);
+                _first = false;
+                _remaining--;
+                _delivered = _reader.position();
+            } else {
+                memcpy(_buffer + _length, "]}", 2);
+                _length += 2;
+                _stage = STAGE_PADDING;
+            }
+        }
+        if (_length > 0) {
+            return true;
+        }
+        
+        // Only if a record became unreadable after sizing: keep the promised
+        // Content-Length with JSON whitespace; delivered() excludes the lost records
+        if (_sent >= _total) {
+            return false;
+        }
+        _length = min(_total - _sent, BUFFER_SIZE);
+        memset(_buffer, ' ', _length);
+        return true;
+    }
+    
+    FitInfinityOfflineStore::Reader _reader;
+    const String& _head;
+    uint32_t _remaining;
+    size_t _total;
+    size_t _sent;
+    Stage _stage;
+    const char* _data;
+    size_t _length;
+    size_t _index;
+    bool _first;
+    uint32_t _delivered;
+    char _buffer[BUFFER_SIZE];
+};
+
+// Response body read straight off the connection, with chunked transfer decoded, so it is
+// parsed as it arrives instead of first being copied into a String. The first bytes are
+// kept as an excerpt for error messages.
+class HttpBodyStream : public Stream {
+  public:
+    static const size_t EXCERPT_SIZE = 128;
+    
+    explicit HttpBodyStream(HTTPClient& http)
+        : _client(http.getStreamPtr()), _remaining(http.getSize()),
+          _chunked(http.header("Transfer-Encoding").equalsIgnoreCase("chunked")),
+          _started(false), _done(false), _excerptLength(0) {
+        _excerpt[0] = '\0';
+        if (_chunked) {
+            _remaining = 0;
+        }
+        
+        // No connection, or an empty body
+        if (!_client || (!_chunked && _remaining == 0)) {
+            _done = true;
+        }
+    }
+    
+    // Start of the body as text, reading up to the excerpt size if it was not parsed
+    String excerpt() {
+        char c;
+        while (_excerptLength < EXCERPT_SIZE && readBytes(&c, 1) == 1) {}
+        return String(_excerpt);
+    }
+    
+    // Consumes the rest of the body, so the kept-alive connection is clean for the next request
+    void discard() {
+        char buffer[64];
+        while (readBytes(buffer, sizeof(buffer)) > 0) {}
+    }
+    
+    int available() {
+        if (!fill()) {
+            return 0;
+        }
+        int ready = _client->available();
+        return _remaining > 0 ? min(ready, (int)_remaining) : ready;
+    }
+    
+    int read() {
+        char c;
+        return readBytes(&c, 1) == 1 ? (uint8_t)c : -1;
+    }
+    
+    int peek() {
+        return fill() ? _client->peek() : -1;
+    }
+    
+    size_t readBytes(char* buffer, size_t length) {
+        size_t copied = 0;
+        while (copied < length && fill()) {
+            size_t wanted = length - copied;
+            if (_remaining > 0 && (size_t)_remaining < wanted) {
+                wanted = _remaining;
+            }
+            
+            // Waits up to the client timeout, like HTTPClient::getString()
+            size_t got = _client->readBytes(buffer + copied, wanted);
+            if (got == 0) {
+                _done = true;
+                break;
+            }
+            keepExcerpt(buffer + copied, got);
+            copied += got;
+            if (_remaining > 0) {
+                _remaining -= got;
+            }
+        }
+        return copied;
+    }
+    
+    size_t write(uint8_t) {
+        return 0;
+    }
+    
+  private:
+    // Positions the client on body data; false at the end of the body
+    bool fill() {
+        if (_done) {
+            return false;
+        }
+        if (_remaining != 0) {
+            return true;    // inside a chunk or the Content-Length, or -1: until the server closes
+        }
+        if (!_chunked) {
+            _done = true;
+            return false;
+        }
+        
+        // Next chunk: the CRLF closing the previous one, then the hex size line
+        if (_started) {
+            readLine();
+        }
+        _started = true;
+        long size = strtol(readLine().c_str(), nullptr, 16);
+        if (size <= 0) {
+            // Last chunk: skip any trailers up to the blank line
+            while (readLine().length() > 0) {}
+            _done = true;
+            return false;
+        }
+        _remaining = size;
+        return true;
+    }
+    
+    String readLine() {
+        String line = _client->readStringUntil('\n');
+        line.trim();
+        return line;
+    }
+    
+    void keepExcerpt(const char* data, size_t length) {
+        size_t kept = min(length, EXCERPT_SIZE - _excerptLength);
+        memcpy(_excerpt + _excerptLength, data, kept);
+        _excerptLength += kept;
+        _excerpt[_excerptLength] = '\0';
+    }
+    
+    WiFiClient* _client;
+    long _remaining;        // body or chunk bytes left; -1 reads until the connection closes
+    bool _chunked;
+    bool _started;
+    bool _done;
+    size_t _excerptLength;
+    char _excerpt[EXCERPT_SIZE + 1];
+};
+
+// Response headers HttpBodyStream needs from HTTPClient
+static const char* RESPONSE_HEADERS[] = {"Transfer-Encoding", "ETag"};
+
+FitInfinityAPI::FitInfinityAPI(const char* baseUrl, const char* deviceId, const char* accessKey)
+    : _scanFilter(SCAN_DUPLICATE_WINDOW) {
     _fingerSensor = nullptr;
     _baseUrl = String(baseUrl);
     _deviceId = String(deviceId);
@@ -15,10 +272,34 @@ FitInfinityAPI::FitInfinityAPI(const char* baseUrl, const char* deviceId, const
     _lastResponseCode = 0;
     _useSDCard = false;
     _sdCardPin = -1;
+    _syncBatchSize = 1000;
+    _enrollmentPageSize = ENROLLMENT_PAGE_SIZE;
+    _queryCredentials = false;
+    _authenticatePending = false;
+    _commitRecords = OFFLINE_SPILL_RECORDS;
+    _commitDelay = OFFLINE_SPILL_DELAY;
+    _httpMutex = nullptr;
+    _requestTask = nullptr;
+    _asyncAttempts = 3;
+    _asyncBaseDelay = 500;
+    _asyncMaxDelay = 8000;
+    _connections.setStartupJitter(HTTP_STARTUP_JITTER);
 }
 
 bool FitInfinityAPI::begin(const char* ssid, const char* password, int8_t sdCardPin) {
     _sdCardPin = sdCardPin;
+    
+    // Offline storage first, so punches are kept even when WiFi is down at boot
+    if (_sdCardPin >= 0) {
+        _useSDCard = initSDCard();
+        if (!_useSDCard) {
+            Serial.println("SD card initialization failed, falling back to internal flash");
+        }
+    }
+    if (!_useSDCard) {
+        initFlashStorage();
+    }
+    
     WiFi.begin(ssid, password);
     
     // Wait for connection with timeout
@@ -32,14 +313,11 @@ bool FitInfinityAPI::begin(const char* ssid, const char* password, int8_t sdCard
     if (_isConnected) {
         initTimeSync();
         
-        // Initialize SD card if pin provided
-        if (_sdCardPin >= 0) {
-            _useSDCard = initSDCard();
-            if (!_useSDCard) {
-                Serial.println("SD card initialization failed, falling back to memory storage");
-            }
+        // Inside the startup jitter window, apiLoop() authenticates once it has passed
+        if (_connections.holdRemaining() > 0) {
+            _authenticatePending = true;
+            return true;
         }
-        
         return authenticate();
     }
     
@@ -56,8 +334,20 @@ bool FitInfinityAPI::authenticate() {
 }
 
 bool FitInfinityAPI::logFingerprint(int fingerId) {
-    if (!isConnected()) {
-        storeOfflineRecord("fingerprint", String(fingerId).c_str(), getTimestamp().c_str());
+    char id[12];
+    snprintf(id, sizeof(id), "%d", fingerId);
+    
+    // A repeat of a scan already logged counts as logged
+    if (isDuplicateScan("fingerprint", id)) {
+        return true;
+    }
+    
+    // Only a punch that was logged or stored starts the duplicate window. Inside the
+    // startup jitter window the punch is stored rather than waiting for a connection
+    if (!isConnected() || _connections.holdRemaining() > 0) {
+        if (writeOfflineRecord("fingerprint", id, getTimestamp().c_str())) {
+            recordScan("fingerprint", id);
+        }
         return false;
     }
     
@@ -67,12 +357,22 @@ bool FitInfinityAPI::logFingerprint(int fingerId) {
     doc["fingerId"] = fingerId;
     doc["timestamp"] = getTimestamp();
     
-    return makeRequest("logFingerprint", doc);
+    if (!makeRequest("logFingerprint", doc)) {
+        return false;
+    }
+    recordScan("fingerprint", id);
+    return true;
 }
 
 bool FitInfinityAPI::logRFID(const char* rfidNumber) {
-    if (!isConnected()) {
-        storeOfflineRecord("rfid", rfidNumber, getTimestamp().c_str());
+    if (isDuplicateScan("rfid", rfidNumber)) {
+        return true;
+    }
+    
+    if (!isConnected() || _connections.holdRemaining() > 0) {
+        if (writeOfflineRecord("rfid", rfidNumber, getTimestamp().c_str())) {
+            recordScan("rfid", rfidNumber);
+        }
         return false;
     }
     
@@ -82,7 +382,11 @@ bool FitInfinityAPI::logRFID(const char* rfidNumber) {
     doc["rfid"] = rfidNumber;
     doc["timestamp"] = getTimestamp();
     
-    return makeRequest("logRFID", doc);
+    if (!makeRequest("logRFID", doc)) {
+        return false;
+    }
+    recordScan("rfid", rfidNumber);
+    return true;
 }
 
 bool FitInfinityAPI::getPendingEnrollments(JsonArray& result) {
@@ -91,48 +395,118 @@ bool FitInfinityAPI::getPendingEnrollments(JsonArray& result) {
         return false;
     }
 
-    HTTPClient http;
-    String url = _baseUrl + "/api/esp32/enrollments/pending";
-    // Add authentication parameters
-    url += "?deviceId=" + _deviceId + "&accessKey=" + _accessKey;
-    http.begin(url);
+    // One page of pending enrollments per request; credentials travel in headers, and in
+    // the query only for legacy servers that ask for it
+    String url = _baseUrl + "/api/esp32/enrollments/pending?limit=" + String(_enrollmentPageSize);
+    if (_queryCredentials) {
+        url += "&deviceId=" + _deviceId + "&accessKey=" + _accessKey;
+    }
+    HttpLock lock(_httpMutex);
+    int httpCode;
+    if (!beginHttp(url, httpCode)) {
+        _lastResponseCode = httpCode;
+        _lastError = httpErrorString(httpCode);
+        return false;
+    }
+    HTTPClient& http = _http;
+    addEnrollmentHeaders(http);
+    
+    httpCode = http.GET();
+    if (retryOnStale(httpCode, url)) {
+        addEnrollmentHeaders(http);
+        httpCode = http.GET();
+    }
+    _lastResponseCode = httpCode;
+    
+    // Nothing changed since the last page that was handed over: no body to read
+    if (httpCode == HTTP_CODE_NOT_MODIFIED) {
+        http.end();
+        return true;
+    }
     
-    int httpCode = http.GET();
     bool success = (httpCode == HTTP_CODE_OK);
+    HttpBodyStream body(http);
     
     if (success) {
-        String payload = http.getString();
-        DynamicJsonDocument doc(1024);
-        DeserializationError error = deserializeJson(doc, payload);
+        // Only the fields used below are kept, however much else the server sends.
+        // Servers without paging answer with a single enrollment or {"status": "none"}.
+        StaticJsonDocument<JSON_OBJECT_SIZE(6) + JSON_ARRAY_SIZE(1) + JSON_OBJECT_SIZE(2)> filter;
+        filter["status"] = true;
+        filter["id"] = true;
+        filter["nama"] = true;
+        filter["hasMore"] = true;
+        filter["more"] = true;
+        filter["enrollments"][0]["id"] = true;
+        filter["enrollments"][0]["nama"] = true;
+        
+        // Sized by the page, not by the response
+        DynamicJsonDocument doc(JSON_OBJECT_SIZE(5) + JSON_ARRAY_SIZE(_enrollmentPageSize) +
+                                _enrollmentPageSize * (JSON_OBJECT_SIZE(2) + ENROLLMENT_ITEM_SIZE));
+        DeserializationError error = deserializeJson(doc, body, DeserializationOption::Filter(filter));
         
         if (!error) {
-            if (doc.containsKey("status") && doc["status"] == "none") {
-                // No pending enrollments
-                success = true;
-            } else {
+            String createdAt = getTimestamp();
+            bool complete = true;
+            
+            JsonArray page = doc["enrollments"];
+            bool paged = !page.isNull();
+            if (page.isNull() && !(doc["status"] == "none")) {
                 // Single enrollment response
+                page = doc.createNestedArray("enrollments");
+                JsonObject single = page.createNestedObject();
+                single["id"] = doc["id"];
+                single["nama"] = doc["nama"];
+            }
+            
+            for (JsonObject enrollment : page) {
                 JsonObject item = result.createNestedObject();
-                item["id"] = doc["id"];
-                item["nama"] = doc["nama"];
+                if (item.isNull()) {
+                    complete = false;
+                    break;
+                }
+                item["id"] = enrollment["id"];
+                item["nama"] = enrollment["nama"];
                 // Default finger_id to 0, will be assigned during enrollment
                 item["finger_id"] = 0;
                 item["status"] = "PENDING";
                 // Add current timestamp as created_at
-                item["created_at"] = getTimestamp();
+                item["created_at"] = createdAt;
+            }
+            
+            // A full page may have more behind it unless the server says otherwise
+            bool lastPage = !paged || page.size() < _enrollmentPageSize;
+            if (doc.containsKey("hasMore")) {
+                lastPage = !doc["hasMore"].as<bool>();
+            } else if (doc.containsKey("more")) {
+                lastPage = !doc["more"].as<bool>();
+            }
+            
+            // Remember the list only once the caller has all of it, or it would never come again
+            _enrollmentETag = (complete && lastPage) ? http.header("ETag") : String("");
+            if (!complete) {
+                _lastError = "Enrollment result array full";
             }
         } else {
             _lastError = "JSON parsing failed";
             success = false;
         }
     } else {
-        _lastError = http.getString();
+        _lastError = body.excerpt();
     }
     
-    _lastResponseCode = httpCode;
+    body.discard();
     http.end();
     return success;
 }
 
+void FitInfinityAPI::setEnrollmentPageSize(uint8_t maxEnrollments) {
+    _enrollmentPageSize = maxEnrollments > 0 ? maxEnrollments : 1;
+}
+
+void FitInfinityAPI::setQueryCredentials(bool enabled) {
+    _queryCredentials = enabled;
+}
+
 bool FitInfinityAPI::beginFingerprint(Stream* stream) {
     if (!stream) {
         _lastError = "Invalid stream for fingerprint sensor";
@@ -206,11 +580,19 @@ bool FitInfinityAPI::updateEnrollmentStatus(const char* employeeId, int fingerpr
         return false;
     }
 
-    HTTPClient http;
     String url = _baseUrl + "/api/esp32/enrollments/status";
-    url += "?deviceId=" + _deviceId + "&accessKey=" + _accessKey;
-    http.begin(url);
+    if (_queryCredentials) {
+        url += "?deviceId=" + _deviceId + "&accessKey=" + _accessKey;
+    }
+    HttpLock lock(_httpMutex);
+    int httpCode;
+    if (!beginHttp(url, httpCode)) {
+        _lastError = httpErrorString(httpCode);
+        return false;
+    }
+    HTTPClient& http = _http;
     http.addHeader("Content-Type", "application/json");
+    addDeviceHeaders(http);
 
     StaticJsonDocument<200> doc;
     doc["employeeId"] = employeeId;
@@ -220,13 +602,23 @@ bool FitInfinityAPI::updateEnrollmentStatus(const char* employeeId, int fingerpr
     String jsonStr;
     serializeJson(doc, jsonStr);
 
-    int httpCode = http.POST(jsonStr);
+    httpCode = http.POST(jsonStr);
+    if (retryOnStale(httpCode, url)) {
+        http.addHeader("Content-Type", "application/json");
+        addDeviceHeaders(http);
+        httpCode = http.POST(jsonStr);
+    }
     bool requestSuccess = (httpCode == HTTP_CODE_OK);
 
+    HttpBodyStream body(http);
     if (!requestSuccess) {
-        _lastError = http.getString();
+        _lastError = httpCode < 0 ? httpErrorString(httpCode) : body.excerpt();
     }
 
+    // Whatever the outcome, the next poll fetches the pending list in full again
+    _enrollmentETag = "";
+
+    body.discard();
     http.end();
     return requestSuccess;
 }
@@ -268,6 +660,9 @@ void FitInfinityAPI::setOfflineStorageMode(bool useSD) {
     } else {
         _useSDCard = false;
     }
+    if (!_useSDCard) {
+        initFlashStorage();
+    }
 }
 
 bool FitInfinityAPI::isSDCardEnabled() {
@@ -275,38 +670,53 @@ bool FitInfinityAPI::isSDCardEnabled() {
 }
 
 String FitInfinityAPI::getOfflineStorageStats() {
-    if (!_useSDCard) {
-        return "SD card not enabled";
+    if (!_offlineStore.isReady()) {
+        return "Offline storage not available";
     }
     
-    File file = SD.open(OFFLINE_FILE);
-    if (!file) {
+    OfflineStats offline = _offlineStore.stats();
+    if (offline.pending == 0) {
         return "No offline records";
     }
     
-    size_t size = file.size();
-    file.close();
-    
-    return "Offline file size: " + String(size) + " bytes";
+    String stats = "Offline records pending: " + String(offline.pending) + " in " +
+                   String(offline.segments) + " segments (" + String(offline.bytes) + " bytes) on " +
+                   (_useSDCard ? "SD card" : "internal flash");
+    time_t now = time(nullptr);
+    if (offline.oldestEpoch > 0 && now > (time_t)offline.oldestEpoch) {
+        stats += ", oldest " + String((unsigned long)(now - offline.oldestEpoch) / 60) + " min ago";
+    }
+    if (offline.corrupted > 0) {
+        stats += ", " + String(offline.corrupted) + " corrupted skipped";
+    }
+    return stats;
 }
 
-void FitInfinityAPI::storeOfflineRecord(const char* type, const char* id, const char* timestamp) {
-    if (_useSDCard) {
-        writeToSDCard(type, id, timestamp);
-        return;
+OfflineStats FitInfinityAPI::getOfflineStats() {
+    if (!_offlineStore.isReady()) {
+        OfflineStats empty = {};
+        return empty;
     }
+    return _offlineStore.stats();
+}
+
+void FitInfinityAPI::storeOfflineRecord(const char* type, const char* id, const char* timestamp) {
+    writeOfflineRecord(type, id, timestamp);
+}
+
+void FitInfinityAPI::apiLoop() {
+    // Results of async logging first, so failed sends join the offline store in order
+    processAsyncResults();
     
-    // Fallback to memory storage
-    StaticJsonDocument<200> doc;
-    doc["type"] = type;
-    doc["id"] = id;
-    doc["timestamp"] = timestamp;
+    // Moves punches buffered in RAM to flash once they have waited long enough
+    _offlineStore.maintain();
     
-    File file = SD.open(OFFLINE_FILE, FILE_APPEND);
-    if (file) {
-        serializeJson(doc, file);
-        file.println();
-        file.close();
+    // Authentication deferred by begin() until the startup jitter let connections through
+    if (_authenticatePending && isConnected() && _connections.holdRemaining() == 0) {
+        _authenticatePending = false;
+        if (!authenticate()) {
+            Serial.println("Deferred authentication failed: " + _lastError);
+        }
     }
 }
 
@@ -315,47 +725,80 @@ bool FitInfinityAPI::syncOfflineRecords() {
         return false;
     }
     
-    StaticJsonDocument<1024> doc;
+    // The reader only sees stored records, so write out anything still in RAM
+    if (!_offlineStore.isReady() || !_offlineStore.flush()) {
+        _lastError = "Offline storage not available";
+        return false;
+    }
+    
+    // Body prefix: the usual request fields, then the records array left open
+    StaticJsonDocument<256> doc;
     doc["deviceId"] = _deviceId;
     doc["accessKey"] = _accessKey;
+    doc["action"] = "bulkLog";
+    String head;
+    serializeJson(doc, head);
+    head.remove(head.length() - 1);
+    head += ",\"records\":[";
     
-    if (_useSDCard) {
-        File file = SD.open(OFFLINE_FILE);
-        if (!file) {
-            return false;
-        }
-        
-        JsonArray records = doc.createNestedArray("records");
-        int recordCount = 0;
-        
-        while (file.available() && recordCount < 50) {  // Process max 50 records at a time
-            String line = file.readStringUntil('\n');
-            StaticJsonDocument<200> recordDoc;
-            DeserializationError error = deserializeJson(recordDoc, line);
-            
-            if (!error) {
-                JsonObject record = records.createNestedObject();
-                record["type"] = recordDoc["type"];
-                record["id"] = recordDoc["id"];
-                record["timestamp"] = recordDoc["timestamp"];
-                recordCount++;
-            }
-        }
-        
-        file.close();
-        
-        if (recordCount > 0) {
-            bool success = makeRequest("bulkLog", doc);
-            if (success) {
-                clearProcessedRecords(recordCount);
-            }
-            return success;
-        }
+    // First pass sizes the body, since HTTPClient needs a Content-Length to stream it
+    FitInfinityOfflineStore::Reader counter(_offlineStore);
+    OfflineRecord record;
+    char piece[BulkLogStream::RECORD_SIZE];
+    size_t length = head.length() + 2;
+    uint32_t recordCount = 0;
+    while (recordCount < _syncBatchSize && counter.next(record)) {
+        length += BulkLogStream::formatRecord(record, recordCount == 0, piece, sizeof(piece));
+        recordCount++;
+    }
+    
+    if (recordCount == 0) {
         return true;  // No records to process
-    } else {
-        // Fallback to memory-based storage (implementation remains same)
+    }
+    
+    HttpLock lock(_httpMutex);
+    if (!beginHttp(_baseUrl, _lastResponseCode)) {
+        _lastError = httpErrorString(_lastResponseCode);
+        return false;
+    }
+    HTTPClient& http = _http;
+    http.addHeader("Content-Type", "application/json");
+    
+    // A stale connection fails on the headers, before any of the body has been read
+    BulkLogStream body(_offlineStore, head, recordCount, length);
+    _lastResponseCode = http.sendRequest("POST", &body, length);
+    if (retryOnStale(_lastResponseCode, _baseUrl)) {
+        http.addHeader("Content-Type", "application/json");
+        _lastResponseCode = http.sendRequest("POST", &body, length);
+    }
+    
+    bool success = readResponse(http, _lastResponseCode, _lastError);
+    if (success) {
+        _offlineStore.commit(body.delivered());
+    }
+    return success;
+}
+
+void FitInfinityAPI::setSyncBatchSize(uint32_t maxRecords) {
+    _syncBatchSize = maxRecords > 0 ? maxRecords : 1;
+}
+
+void FitInfinityAPI::setOfflineCommitPolicy(uint16_t maxRecords, unsigned long maxDelayMs) {
+    // 1 record writes every punch through; larger batches trade loss on a power cut for latency
+    _commitRecords = maxRecords > 0 ? maxRecords : 1;
+    _commitDelay = maxDelayMs;
+    _offlineStore.setSpillPolicy(_commitRecords, _commitDelay);
+}
+
+void FitInfinityAPI::setOfflineCompression(bool enabled) {
+    _offlineStore.setPacking(enabled);
+}
+
+bool FitInfinityAPI::flushOfflineRecords() {
+    if (!_offlineStore.isReady()) {
         return false;
     }
+    return _offlineStore.flush();
 }
 
 bool FitInfinityAPI::isConnected() {
@@ -381,6 +824,12 @@ String FitInfinityAPI::getTimestamp() {
     return "";
 }
 
+void FitInfinityAPI::setDeviceId(const char* id) {
+    // The request worker reads the ID while it builds a request
+    HttpLock lock(_httpMutex);
+    _deviceId = String(id);
+}
+
 void FitInfinityAPI::setNTPServer(const char* server) {
     _ntpServer = String(server);
     initTimeSync();
@@ -390,6 +839,41 @@ void FitInfinityAPI::setTimeout(uint16_t timeoutMs) {
     _timeout = timeoutMs;
 }
 
+void FitInfinityAPI::setDuplicateWindow(unsigned long windowMs) {
+    _scanFilter.setWindow(windowMs);
+}
+
+uint32_t FitInfinityAPI::getSuppressedScans() {
+    return _scanFilter.suppressed();
+}
+
+ConnectionPoolStats FitInfinityAPI::getConnectionStats() {
+    // The request worker updates these while it holds the lock
+    HttpLock lock(_httpMutex);
+    return _connections.stats();
+}
+
+void FitInfinityAPI::setStartupJitter(uint32_t windowMs) {
+    HttpLock lock(_httpMutex);
+    _connections.setStartupJitter(windowMs);
+}
+
+bool FitInfinityAPI::isDuplicateScan(const char* type, const char* id) {
+    if (!_scanFilter.isRepeat(type, id, millis())) {
+        return false;
+    }
+    Serial.println("Duplicate " + String(type) + " scan suppressed: " + String(id));
+    return true;
+}
+
+void FitInfinityAPI::recordScan(const char* type, const char* id) {
+    _scanFilter.record(type, id, millis());
+}
+
+void FitInfinityAPI::forgetScan(const char* type, const char* id) {
+    _scanFilter.forget(type, id);
+}
+
 // Private methods
 bool FitInfinityAPI::makeRequest(const char* action, JsonDocument& doc) {
     if (!isConnected()) {
@@ -397,9 +881,12 @@ bool FitInfinityAPI::makeRequest(const char* action, JsonDocument& doc) {
         return false;
     }
     
-    HTTPClient http;
-    String url = _baseUrl;
-    http.begin(url);
+    HttpLock lock(_httpMutex);
+    if (!beginHttp(_baseUrl, _lastResponseCode)) {
+        _lastError = httpErrorString(_lastResponseCode);
+        return false;
+    }
+    HTTPClient& http = _http;
     http.addHeader("Content-Type", "application/json");
     
     doc["action"] = action;
@@ -408,37 +895,109 @@ bool FitInfinityAPI::makeRequest(const char* action, JsonDocument& doc) {
     serializeJson(doc, jsonStr);
     
     _lastResponseCode = http.POST(jsonStr);
+    if (retryOnStale(_lastResponseCode, _baseUrl)) {
+        http.addHeader("Content-Type", "application/json");
+        _lastResponseCode = http.POST(jsonStr);
+    }
     
-    String response = http.getString();
-    http.end();
+    return readResponse(http, _lastResponseCode, _lastError);
+}
 
-    if (_lastResponseCode != HTTP_CODE_OK) {
-        // HTTP error
-        _lastError = response;
+bool FitInfinityAPI::beginHttp(const String& url, int& httpCode) {
+    // Nothing to send over: held back by the startup jitter, or the connect failed
+    WiFiClient* transport = _connections.acquire(url, HTTP_CONNECT_TIMEOUT);
+    if (!transport) {
+        httpCode = _connections.holdRemaining() > 0 ? HTTP_CONNECT_DEFERRED : HTTPC_ERROR_CONNECTION_REFUSED;
         return false;
     }
+    
+    // With reuse on, end() leaves a keep-alive connection open and the next begin()
+    // sends over it
+    _http.setReuse(true);
+    _http.begin(*transport, url);
+    _http.collectHeaders(RESPONSE_HEADERS, sizeof(RESPONSE_HEADERS) / sizeof(RESPONSE_HEADERS[0]));
+    return true;
+}
+
+void FitInfinityAPI::addDeviceHeaders(HTTPClient& http) {
+    http.addHeader("X-Device-ID", _deviceId);
+    http.addHeader("X-Access-Key", _accessKey);
+}
+
+void FitInfinityAPI::addEnrollmentHeaders(HTTPClient& http) {
+    addDeviceHeaders(http);
+    
+    // Lets the server answer 304 with no body while the pending list is unchanged
+    if (_enrollmentETag.length() > 0) {
+        http.addHeader("If-None-Match", _enrollmentETag);
+    }
+}
 
-    // Parse response body
-    StaticJsonDocument<512> respDoc;
-    DeserializationError error = deserializeJson(respDoc, response);
-    if (error) {
-        _lastError = "Invalid JSON response";
+bool FitInfinityAPI::retryOnStale(int& httpCode, const String& url) {
+    // Nothing reached the server: the kept-alive socket had died without us noticing
+    if (httpCode != HTTPC_ERROR_SEND_HEADER_FAILED && httpCode != HTTPC_ERROR_NOT_CONNECTED) {
         return false;
     }
+    _http.end();
+    _connections.close(url);
+    
+    // A failed reconnect is reported in httpCode instead of the stale send
+    return beginHttp(url, httpCode);
+}
+
+String FitInfinityAPI::httpErrorString(int httpCode) {
+    if (httpCode == HTTP_CONNECT_DEFERRED) {
+        return "Connection held back by the startup jitter";
+    }
+    return HTTPClient::errorToString(httpCode);
+}
 
-    // Check if response has "success": true
-    if (respDoc.containsKey("success") && respDoc["success"] == true) {
-        return true;
+void FitInfinityAPI::closeHttp() {
+    HttpLock lock(_httpMutex);
+    _http.end();
+    _connections.closeAll();
+}
+
+bool FitInfinityAPI::readResponse(HTTPClient& http, int httpCode, String& error) {
+    HttpBodyStream body(http);
+    bool success = false;
+
+    if (httpCode < 0) {
+        // No response at all
+        error = httpErrorString(httpCode);
+    } else if (httpCode != HTTP_CODE_OK) {
+        // HTTP error
+        error = body.excerpt();
     } else {
-        // handle error message
-        _lastError = response;
-        return false;
+        // Parse the body as it arrives, keeping only "success" however verbose the rest is
+        StaticJsonDocument<JSON_OBJECT_SIZE(1)> filter;
+        filter["success"] = true;
+        StaticJsonDocument<64> respDoc;
+        DeserializationError parseError = deserializeJson(respDoc, body, DeserializationOption::Filter(filter));
+        if (parseError) {
+            error = "Invalid JSON response";
+        } else if (respDoc["success"] == true) {
+            success = true;
+        } else {
+            // handle error message
+            error = body.excerpt();
+        }
     }
+
+    body.discard();
+    http.end();
+    return success;
 }
 
 
 void FitInfinityAPI::updateConnectionStatus() {
+    bool wasConnected = _isConnected;
     _isConnected = (WiFi.status() == WL_CONNECTED);
+    
+    // A kept-alive socket does not survive losing WiFi
+    if (wasConnected && !_isConnected) {
+        closeHttp();
+    }
 }
 
 void FitInfinityAPI::initTimeSync() {
@@ -450,60 +1009,61 @@ bool FitInfinityAPI::initSDCard() {
         _lastError = "Failed to initialize SD card";
         return false;
     }
-    return true;
-}
-
-bool FitInfinityAPI::writeToSDCard(const char* type, const char* id, const char* timestamp) {
-    if (!_useSDCard) return false;
     
-    File file = SD.open(OFFLINE_FILE, FILE_APPEND);
-    if (!file) {
-        _lastError = "Could not open offline storage file";
+    // Punches are group-committed so a slow card does not pay a FAT update for each one
+    if (!_offlineStore.begin(SD) ||
+        !_offlineStore.setMemoryTier(OFFLINE_MEMORY_RECORDS, _commitRecords, _commitDelay)) {
+        _lastError = "Failed to open offline store";
         return false;
     }
     
-    StaticJsonDocument<200> doc;
-    doc["type"] = type;
-    doc["id"] = id;
-    doc["timestamp"] = timestamp;
-    
-    serializeJson(doc, file);
-    file.println();
-    file.close();
-    return true;
+    migrateLegacyOfflineFile();
+    return _offlineStore.flush();
 }
 
-bool FitInfinityAPI::clearProcessedRecords(int count) {
-    if (!_useSDCard || count <= 0) return false;
-    
-    File sourceFile = SD.open(OFFLINE_FILE);
-    File tempFile = SD.open(OFFLINE_TEMP, FILE_WRITE);
-    
-    if (!sourceFile || !tempFile) {
+bool FitInfinityAPI::initFlashStorage() {
+    // LittleFS partition on internal flash; formatted only if it cannot be mounted
+    if (!LittleFS.begin(true) || !_offlineStore.begin(LittleFS)) {
+        _lastError = "Failed to open offline store on internal flash";
         return false;
     }
     
-    // Skip processed records
-    for (int i = 0; i < count; i++) {
-        if (sourceFile.available()) {
-            sourceFile.readStringUntil('\n');
-        }
+    // Flash pages wear out, so punches are batched in RAM before they are written
+    size_t capacity = psramFound() ? OFFLINE_PSRAM_RECORDS : OFFLINE_MEMORY_RECORDS;
+    return _offlineStore.setMemoryTier(capacity, _commitRecords, _commitDelay);
+}
+
+bool FitInfinityAPI::writeOfflineRecord(const char* type, const char* id, const char* timestamp) {
+    uint8_t recordType = FitInfinityOfflineStore::parseType(type);
+    uint32_t epoch = FitInfinityOfflineStore::parseTimestamp(timestamp);
+    if (!_offlineStore.append(recordType, id, epoch)) {
+        _lastError = "Could not write offline record";
+        return false;
     }
+    return true;
+}
+
+void FitInfinityAPI::migrateLegacyOfflineFile() {
+    // Records left by older firmware in /offline.txt move into the segmented store once
+    File file = SD.open(OFFLINE_FILE);
+    if (!file) return;
     
-    // Copy remaining records to temp file
-    while (sourceFile.available()) {
-        String line = sourceFile.readStringUntil('\n');
-        tempFile.println(line);
+    int migrated = 0;
+    while (file.available()) {
+        String line = file.readStringUntil('\n');
+        StaticJsonDocument<200> doc;
+        if (deserializeJson(doc, line)) {
+            continue;
+        }
+        
+        uint8_t type = FitInfinityOfflineStore::parseType(doc["type"] | "");
+        uint32_t epoch = FitInfinityOfflineStore::parseTimestamp(doc["timestamp"] | "");
+        if (_offlineStore.append(type, doc["id"] | "", epoch)) {
+            migrated++;
+        }
     }
+    file.close();
     
-    sourceFile.close();
-    tempFile.close();
-    
-    // Replace original file with temp file
     SD.remove(OFFLINE_FILE);
-    return renameFile(OFFLINE_TEMP, OFFLINE_FILE);
+    Serial.println("Migrated " + String(migrated) + " offline records");
 }
-
-bool FitInfinityAPI::renameFile(const char* from, const char* to) {
-    return SD.rename(from, to);
-}
\ No newline at end of file
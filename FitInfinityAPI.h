@@ -6,7 +6,81 @@
 #include <HTTPClient.h>
 #include <ArduinoJson.h>
 #include <SD.h>
+#include <LittleFS.h>
 #include <Adafruit_Fingerprint.h>
+#include "FitInfinityOfflineStore.h"
+#include "FitInfinityScanFilter.h"
+#include "FitInfinityConnectionPool.h"
+#include "FitInfinityRing.h"
+
+// RAM tier in front of offline storage, in records
+#ifndef OFFLINE_MEMORY_RECORDS
+#define OFFLINE_MEMORY_RECORDS 64
+#endif
+
+#ifndef OFFLINE_PSRAM_RECORDS
+#define OFFLINE_PSRAM_RECORDS 4096
+#endif
+
+// Duplicate scan suppression: distinct fingers/cards remembered, default window in ms
+#ifndef SCAN_FILTER_SIZE
+#define SCAN_FILTER_SIZE 16
+#endif
+
+#ifndef SCAN_DUPLICATE_WINDOW
+#define SCAN_DUPLICATE_WINDOW 10000
+#endif
+
+// Hosts kept connected at once (API and OTA), and the connect timeout in ms
+#ifndef HTTP_POOL_SIZE
+#define HTTP_POOL_SIZE 2
+#endif
+
+#ifndef HTTP_CONNECT_TIMEOUT
+#define HTTP_CONNECT_TIMEOUT 5000
+#endif
+
+// The first handshake after boot starts at a random point within this many ms of boot
+#ifndef HTTP_STARTUP_JITTER
+#define HTTP_STARTUP_JITTER 5000
+#endif
+
+// httpCode of a request not sent because the startup jitter still holds connections back
+#define HTTP_CONNECT_DEFERRED -100
+
+// Pending enrollments fetched per request, and parse memory reserved per enrollment
+#ifndef ENROLLMENT_PAGE_SIZE
+#define ENROLLMENT_PAGE_SIZE 20
+#endif
+
+#ifndef ENROLLMENT_ITEM_SIZE
+#define ENROLLMENT_ITEM_SIZE 96
+#endif
+
+// Attendance requests waiting for the HTTP worker task
+#ifndef HTTP_ASYNC_QUEUE_SIZE
+#define HTTP_ASYNC_QUEUE_SIZE 16        // power of two
+#endif
+
+// Outcome of a non-blocking attendance log, reported to its callback from apiLoop()
+enum AttendanceResult {
+    ATTENDANCE_LOGGED,          // accepted by the server, or a suppressed repeat
+    ATTENDANCE_REJECTED,        // the server answered with an error; not retried
+    ATTENDANCE_STORED_OFFLINE,  // unreachable after retries, or queue full: kept for sync
+    ATTENDANCE_FAILED           // neither sent nor stored
+};
+
+typedef void (*AttendanceCallback)(const char* type, const char* id, AttendanceResult result, int httpCode);
+
+// Scan on its way to or back from the HTTP worker task
+struct AsyncAttendance {
+    char type[12];
+    char id[24];
+    char timestamp[25];
+    AttendanceCallback callback;
+    AttendanceResult result;    // set by the worker
+    int httpCode;
+};
 
 class FitInfinityAPI {
   public:
@@ -22,8 +96,18 @@ class FitInfinityAPI {
     bool logFingerprint(int fingerId);
     bool logRFID(const char* rfidNumber);
     
+    // Non-blocking logging: the round trip runs on a worker task and the callback runs in
+    // apiLoop(). Returns false when the scan went straight to offline storage instead.
+    bool logFingerprintAsync(int fingerId, AttendanceCallback callback = nullptr);
+    bool logRFIDAsync(const char* rfidNumber, AttendanceCallback callback = nullptr);
+    bool startRequestWorker(BaseType_t core = 0, uint32_t stackSize = 8192, UBaseType_t priority = 1);
+    void setAsyncRetryPolicy(uint8_t maxAttempts, unsigned long baseDelayMs, unsigned long maxDelayMs);
+    uint32_t getAsyncPending();
+    
     // Enrollment methods
     bool getPendingEnrollments(JsonArray& result);
+    void setEnrollmentPageSize(uint8_t maxEnrollments);
+    void setQueryCredentials(bool enabled);     // legacy servers only; puts the key in URLs
     bool beginFingerprint(Stream* stream);
     bool enrollFingerprint(int id);
     bool updateEnrollmentStatus(const char* employeeId, int fingerprintId, bool success);
@@ -32,20 +116,60 @@ class FitInfinityAPI {
     // Offline storage
     void storeOfflineRecord(const char* type, const char* id, const char* timestamp);
     bool syncOfflineRecords();
+    void setSyncBatchSize(uint32_t maxRecords);
+    void setOfflineCommitPolicy(uint16_t maxRecords, unsigned long maxDelayMs);
+    bool flushOfflineRecords();
+    void setOfflineCompression(bool enabled);
     void setOfflineStorageMode(bool useSD);
     bool isSDCardEnabled();
     String getOfflineStorageStats();
+    OfflineStats getOfflineStats();
+    void apiLoop();
     
     // Status methods
     bool isConnected();
     String getLastError();
     int getLastResponseCode();
     
+    // Duplicate scan suppression (0 disables)
+    void setDuplicateWindow(unsigned long windowMs);
+    uint32_t getSuppressedScans();
+    
+    // Connection reuse: hits skipped the TCP/TLS handshake, misses paid for one
+    ConnectionPoolStats getConnectionStats();
+    void setStartupJitter(uint32_t windowMs);
+    
     // Helper functions
+    void setDeviceId(const char* id);
     String getTimestamp();
     void setNTPServer(const char* server);
     void setTimeout(uint16_t timeoutMs);
 
+  protected:
+    // Shared with FitInfinityMQTT, which can drain it over the broker connection
+    FitInfinityOfflineStore _offlineStore;
+    
+    bool isDuplicateScan(const char* type, const char* id);
+    void recordScan(const char* type, const char* id);
+    void forgetScan(const char* type, const char* id);
+    
+    // Kept-alive connections per host; OTA downloads draw from the same pool
+    FitInfinityConnectionPool<HTTP_POOL_SIZE> _connections;
+    SemaphoreHandle_t _httpMutex;       // recursive; guards _http and _connections
+    
+    // Holds _httpMutex for a scope; does nothing until the request worker is started
+    class HttpLock {
+      public:
+        explicit HttpLock(SemaphoreHandle_t mutex) : _mutex(mutex) {
+            if (_mutex) xSemaphoreTakeRecursive(_mutex, portMAX_DELAY);
+        }
+        ~HttpLock() {
+            if (_mutex) xSemaphoreGiveRecursive(_mutex);
+        }
+      private:
+        SemaphoreHandle_t _mutex;
+    };
+
   private:
     // Configuration
     String _baseUrl;
@@ -57,26 +181,56 @@ class FitInfinityAPI {
     
     // State
     bool _isConnected;
+    bool _authenticatePending;      // begin() ran inside the startup jitter window
     String _lastError;
     int _lastResponseCode;
     bool _useSDCard;
     int8_t _sdCardPin;
+    uint32_t _syncBatchSize;
+    uint8_t _enrollmentPageSize;
+    String _enrollmentETag;         // validator of the last pending list fully handed over
+    bool _queryCredentials;         // also send deviceId/accessKey in enrollment URLs
+    uint16_t _commitRecords;        // group commit of offline appends: count...
+    unsigned long _commitDelay;     // ...or age of the oldest buffered punch
+    FitInfinityScanFilter<SCAN_FILTER_SIZE> _scanFilter;
+    
+    // Keep-alive connection to the API host, shared by every request
+    HTTPClient _http;
     
-    // Offline storage paths
-    static const char* OFFLINE_FILE;
-    static const char* OFFLINE_TEMP;
+    // Async attendance: requests to the worker task, results back to apiLoop()
+    TaskHandle_t _requestTask;
+    FitInfinityRing<AsyncAttendance, HTTP_ASYNC_QUEUE_SIZE> _asyncRequests;
+    FitInfinityRing<AsyncAttendance, HTTP_ASYNC_QUEUE_SIZE> _asyncResults;
+    uint8_t _asyncAttempts;
+    unsigned long _asyncBaseDelay;
+    unsigned long _asyncMaxDelay;
+    
+    // Offline storage
+    static const char* OFFLINE_FILE;    // legacy JSON-lines log, migrated on begin
     
     // Internal methods
     bool makeRequest(const char* action, JsonDocument& doc);
+    bool readResponse(HTTPClient& http, int httpCode, String& error);
+    bool beginHttp(const String& url, int& httpCode);
+    void addDeviceHeaders(HTTPClient& http);
+    void addEnrollmentHeaders(HTTPClient& http);
+    bool retryOnStale(int& httpCode, const String& url);
+    static String httpErrorString(int httpCode);
+    void closeHttp();
     void updateConnectionStatus();
     void initTimeSync();
     bool initSDCard();
+    bool initFlashStorage();
+    
+    // Offline storage operations
+    bool writeOfflineRecord(const char* type, const char* id, const char* timestamp);
+    void migrateLegacyOfflineFile();
     
-    // SD Card operations
-    bool writeToSDCard(const char* type, const char* id, const char* timestamp);
-    bool readFromSDCard(JsonArray& records);
-    bool clearProcessedRecords(int count);
-    bool renameFile(const char* from, const char* to);
+    // Async attendance
+    bool queueAttendance(const char* type, const char* id, AttendanceCallback callback);
+    bool sendAttendance(const AsyncAttendance& request, int& httpCode);
+    void processAsyncResults();
+    static void requestTaskEntry(void* arg);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,188 @@
+#include "FitInfinityAPI.h"
+
+// Asynchronous Attendance Logging
+
+bool FitInfinityAPI::logFingerprintAsync(int fingerId, AttendanceCallback callback) {
+    char id[12];
+    snprintf(id, sizeof(id), "%d", fingerId);
+    return queueAttendance("fingerprint", id, callback);
+}
+
+bool FitInfinityAPI::logRFIDAsync(const char* rfidNumber, AttendanceCallback callback) {
+    return queueAttendance("rfid", rfidNumber, callback);
+}
+
+bool FitInfinityAPI::startRequestWorker(BaseType_t core, uint32_t stackSize, UBaseType_t priority) {
+    if (_requestTask) {
+        return true;
+    }
+    
+    // From here on the loop task and the worker share _http, so every request takes the lock
+    if (!_httpMutex) {
+        _httpMutex = xSemaphoreCreateRecursiveMutex();
+        if (!_httpMutex) {
+            _lastError = "Failed to create HTTP mutex";
+            return false;
+        }
+    }
+    
+    if (xTaskCreatePinnedToCore(requestTaskEntry, "fitinfinity-http", stackSize, this,
+                                priority, &_requestTask, core) != pdPASS) {
+        _lastError = "Failed to start HTTP request task";
+        _requestTask = nullptr;
+        return false;
+    }
+    return true;
+}
+
+void FitInfinityAPI::setAsyncRetryPolicy(uint8_t maxAttempts, unsigned long baseDelayMs, unsigned long maxDelayMs) {
+    _asyncAttempts = maxAttempts > 0 ? maxAttempts : 1;
+    _asyncBaseDelay = baseDelayMs;
+    _asyncMaxDelay = max(baseDelayMs, maxDelayMs);
+}
+
+uint32_t FitInfinityAPI::getAsyncPending() {
+    return _asyncRequests.size();
+}
+
+bool FitInfinityAPI::queueAttendance(const char* type, const char* id, AttendanceCallback callback) {
+    // A repeat of a scan already logged counts as logged
+    if (isDuplicateScan(type, id)) {
+        if (callback) callback(type, id, ATTENDANCE_LOGGED, 0);
+        return true;
+    }
+    
+    // The timestamp is taken now, so retries and queueing do not move the punch
+    String timestamp = getTimestamp();
+    AsyncAttendance* request = nullptr;
+    if (isConnected() && startRequestWorker()) {
+        request = _asyncRequests.reserve();
+    }
+    
+    // Offline, or the queue is backed up: keep the punch like the blocking calls do
+    if (!request) {
+        bool stored = writeOfflineRecord(type, id, timestamp.c_str());
+        if (stored) {
+            recordScan(type, id);
+        }
+        if (callback) callback(type, id, stored ? ATTENDANCE_STORED_OFFLINE : ATTENDANCE_FAILED, 0);
+        return false;
+    }
+    
+    memset(request, 0, sizeof(AsyncAttendance));
+    strncpy(request->type, type, sizeof(request->type) - 1);
+    strncpy(request->id, id, sizeof(request->id) - 1);
+    strncpy(request->timestamp, timestamp.c_str(), sizeof(request->timestamp) - 1);
+    request->callback = callback;
+    _asyncRequests.commit();
+    
+    // Marked while in flight, so a second tap before the result is not sent again
+    recordScan(type, id);
+    return true;
+}
+
+void FitInfinityAPI::requestTaskEntry(void* arg) {
+    FitInfinityAPI* self = static_cast<FitInfinityAPI*>(arg);
+    uint8_t attempt = 0;
+    bool degraded = false;  // the last request ran out of retries: try the rest once each
+    
+    for (;;) {
+        AsyncAttendance* request = self->_asyncRequests.front();
+        if (!request) {
+            vTaskDelay(pdMS_TO_TICKS(10));
+            continue;
+        }
+        
+        // Early after boot the request waits here, not in the caller, until the startup
+        // jitter lets connections through
+        uint32_t hold = self->_connections.holdRemaining();
+        if (hold > 0) {
+            vTaskDelay(pdMS_TO_TICKS(min(hold, (uint32_t)100)));
+            continue;
+        }
+        
+        int httpCode = HTTPC_ERROR_NOT_CONNECTED;
+        bool sent = WiFi.status() == WL_CONNECTED && self->sendAttendance(*request, httpCode);
+        
+        // Transport errors and server faults may pass; any other answer is final
+        bool retryable = !sent && (httpCode < 0 || httpCode >= 500);
+        attempt++;
+        if (retryable && !degraded && attempt < self->_asyncAttempts) {
+            unsigned long wait = self->_asyncBaseDelay;
+            for (uint8_t i = 1; i < attempt && wait < self->_asyncMaxDelay; i++) {
+                wait *= 2;
+            }
+            vTaskDelay(pdMS_TO_TICKS(min(wait, self->_asyncMaxDelay)));
+            continue;
+        }
+        degraded = retryable;
+        attempt = 0;
+        
+        request->result = sent ? ATTENDANCE_LOGGED : (retryable ? ATTENDANCE_STORED_OFFLINE : ATTENDANCE_REJECTED);
+        request->httpCode = httpCode;
+        
+        // The request stays queued until its result is handed over, so nothing is lost
+        // while the loop task is slow to call apiLoop()
+        while (!self->_asyncResults.push(*request)) {
+            vTaskDelay(pdMS_TO_TICKS(10));
+        }
+        self->_asyncRequests.pop();
+    }
+}
+
+bool FitInfinityAPI::sendAttendance(const AsyncAttendance& request, int& httpCode) {
+    bool fingerprint = strcmp(request.type, "fingerprint") == 0;
+    
+    // Held from the start: setDeviceId() may change the credentials meanwhile
+    HttpLock lock(_httpMutex);
+    StaticJsonDocument<256> doc;
+    doc["deviceId"] = _deviceId;
+    doc["accessKey"] = _accessKey;
+    if (fingerprint) {
+        doc["fingerId"] = atoi(request.id);
+    } else {
+        doc["rfid"] = (const char*)request.id;
+    }
+    doc["timestamp"] = (const char*)request.timestamp;
+    doc["action"] = fingerprint ? "logFingerprint" : "logRFID";
+    
+    String jsonStr;
+    serializeJson(doc, jsonStr);
+    
+    if (!beginHttp(_baseUrl, httpCode)) {
+        return false;
+    }
+    HTTPClient& http = _http;
+    http.addHeader("Content-Type", "application/json");
+    
+    httpCode = http.POST(jsonStr);
+    if (retryOnStale(httpCode, _baseUrl)) {
+        http.addHeader("Content-Type", "application/json");
+        httpCode = http.POST(jsonStr);
+    }
+    
+    // _lastError belongs to the loop task
+    String error;
+    return readResponse(http, httpCode, error);
+}
+
+void FitInfinityAPI::processAsyncResults() {
+    AsyncAttendance* result;
+    while ((result = _asyncResults.front()) != nullptr) {
+        if (result->result == ATTENDANCE_STORED_OFFLINE &&
+            !writeOfflineRecord(result->type, result->id, result->timestamp)) {
+            result->result = ATTENDANCE_FAILED;
+        }
+        // Logged or stored: the window restarts from the outcome. Otherwise the in-flight
+        // mark is dropped, so the member can try again at once
+        if (result->result == ATTENDANCE_LOGGED || result->result == ATTENDANCE_STORED_OFFLINE) {
+            recordScan(result->type, result->id);
+        } else {
+            forgetScan(result->type, result->id);
+        }
+        if (result->callback) {
+            result->callback(result->type, result->id, result->result, result->httpCode);
+        }
+        _asyncResults.pop();
+    }
+}
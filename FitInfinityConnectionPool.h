@@ -0,0 +1,187 @@
+#ifndef FitInfinityConnectionPool_h
+#define FitInfinityConnectionPool_h
+
+#include <Arduino.h>
+#include <WiFiClient.h>
+#include <WiFiClientSecure.h>
+
+struct ConnectionPoolStats {
+    uint32_t hits;              // requests sent over a connection that was already open
+    uint32_t misses;            // requests that opened a new TCP (and TLS) connection
+    uint32_t failures;          // handshakes that failed; those requests were not sent
+    uint32_t handshakeMillis;   // total time spent in successful handshakes
+};
+
+// Kept-alive transport connections, one per host, so repeat requests to the API and OTA
+// hosts skip the TCP and TLS handshakes. The least recently used host is dropped when
+// every slot is taken. Not thread-safe; use from one task, except holdRemaining().
+template <size_t N>
+class FitInfinityConnectionPool {
+    static_assert(N > 0, "FitInfinityConnectionPool needs at least one slot");
+
+  public:
+    FitInfinityConnectionPool() : _clock(0), _notBefore(0) {
+        _stats.hits = _stats.misses = _stats.failures = _stats.handshakeMillis = 0;
+        for (size_t i = 0; i < N; i++) {
+            _slots[i].host[0] = '\0';
+            _slots[i].port = 0;
+            _slots[i].secure = false;
+            _slots[i].lastUsed = 0;
+            // Same certificate handling as HTTPClient::begin(url) without a CA
+            _slots[i].tls.setInsecure();
+        }
+    }
+
+    // Transport for the URL's host, connected; nullptr for a bad URL, while the startup
+    // jitter holds new handshakes back, or when the connect failed
+    WiFiClient* acquire(const String& url, int32_t connectTimeoutMs) {
+        char host[sizeof(_slots[0].host)];
+        uint16_t port;
+        bool secure;
+        if (!parseUrl(url, host, sizeof(host), port, secure)) {
+            return nullptr;
+        }
+
+        Slot* slot = find(host, port, secure);
+        if (slot && transport(*slot).connected()) {
+            slot->lastUsed = ++_clock;
+            _stats.hits++;
+            return &transport(*slot);
+        }
+
+        // Nothing is opened before the deadline; callers defer the request instead of waiting
+        if (holdRemaining() > 0) {
+            return nullptr;
+        }
+
+        if (!slot) {
+            slot = &_slots[0];
+            for (size_t i = 1; i < N; i++) {
+                if (_slots[i].lastUsed < slot->lastUsed) {
+                    slot = &_slots[i];
+                }
+            }
+            transport(*slot).stop();
+            strlcpy(slot->host, host, sizeof(slot->host));
+            slot->port = port;
+            slot->secure = secure;
+        }
+        slot->lastUsed = ++_clock;
+
+        // Connect here rather than in HTTPClient so the handshake cost can be measured
+        WiFiClient& client = transport(*slot);
+        client.stop();
+        unsigned long started = millis();
+        if (!client.connect(host, port, connectTimeoutMs)) {
+            client.stop();
+            _stats.failures++;
+            return nullptr;
+        }
+        _stats.misses++;
+        _stats.handshakeMillis += millis() - started;
+        return &client;
+    }
+
+    // Drops the connection to the URL's host, e.g. after it turned out to be dead
+    void close(const String& url) {
+        char host[sizeof(_slots[0].host)];
+        uint16_t port;
+        bool secure;
+        if (!parseUrl(url, host, sizeof(host), port, secure)) {
+            return;
+        }
+        Slot* slot = find(host, port, secure);
+        if (slot) {
+            transport(*slot).stop();
+        }
+    }
+
+    void closeAll() {
+        for (size_t i = 0; i < N; i++) {
+            transport(_slots[i]).stop();
+        }
+    }
+
+    ConnectionPoolStats stats() const {
+        return _stats;
+    }
+
+    // The first handshake after boot is held back to a random point within this many ms of
+    // boot, so a fleet that rebooted together does not hit the server and its TLS all at
+    // once; 0 connects right away
+    void setStartupJitter(uint32_t windowMs) {
+        _notBefore = windowMs > 0 ? random(windowMs + 1) : 0;
+    }
+
+    // ms until new connections may be opened, 0 once the deadline has passed.
+    // Safe to call from any task: the deadline only ever moves to 0
+    uint32_t holdRemaining() {
+        unsigned long notBefore = _notBefore;
+        if (notBefore == 0) {
+            return 0;
+        }
+        unsigned long now = millis();
+        if (now >= notBefore) {
+            _notBefore = 0;
+            return 0;
+        }
+        return notBefore - now;
+    }
+
+  private:
+    struct Slot {
+        char host[64];
+        uint16_t port;
+        bool secure;
+        uint32_t lastUsed;
+        WiFiClient tcp;
+        WiFiClientSecure tls;
+    };
+
+    static WiFiClient& transport(Slot& slot) {
+        return slot.secure ? slot.tls : slot.tcp;
+    }
+
+    Slot* find(const char* host, uint16_t port, bool secure) {
+        for (size_t i = 0; i < N; i++) {
+            if (_slots[i].port == port && _slots[i].secure == secure && strcmp(_slots[i].host, host) == 0) {
+                return &_slots[i];
+            }
+        }
+        return nullptr;
+    }
+
+    // "scheme://host[:port]/..." with the scheme's default port
+    static bool parseUrl(const String& url, char* host, size_t size, uint16_t& port, bool& secure) {
+        const char* start = url.c_str();
+        if (strncmp(start, "https://", 8) == 0) {
+            secure = true;
+            start += 8;
+        } else if (strncmp(start, "http://", 7) == 0) {
+            secure = false;
+            start += 7;
+        } else {
+            return false;
+        }
+
+        size_t length = strcspn(start, ":/?");
+        if (length == 0 || length >= size) {
+            return false;
+        }
+        memcpy(host, start, length);
+        host[length] = '\0';
+
+        port = secure ? 443 : 80;
+        if (start[length] == ':') {
+            port = (uint16_t)atoi(start + length + 1);
+        }
+        return port != 0;
+    }
+
+    Slot _slots[N];
+    uint32_t _clock;
+    volatile unsigned long _notBefore;  // ms since boot; 0 once passed
+    ConnectionPoolStats _stats;
+};
+
+#endif
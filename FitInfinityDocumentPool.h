@@ -0,0 +1,68 @@
+#ifndef FitInfinityDocumentPool_h
+#define FitInfinityDocumentPool_h
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <atomic>
+
+// Fixed set of preallocated JSON documents handed out for the duration of a scope.
+// Safe to lease from several tasks at once; never touches the heap.
+template <size_t Size, size_t N>
+class FitInfinityDocumentPool {
+    static_assert(N > 0 && N <= 32, "FitInfinityDocumentPool holds 1 to 32 documents");
+
+  public:
+    FitInfinityDocumentPool() : _busy(0), _exhausted(0) {}
+
+    // Borrows a cleared document until it goes out of scope; false when the pool is empty
+    class Lease {
+      public:
+        explicit Lease(FitInfinityDocumentPool& pool) : _pool(pool), _index(pool.acquire()) {}
+        ~Lease() {
+            if (_index >= 0) _pool.release(_index);
+        }
+        explicit operator bool() const { return _index >= 0; }
+        JsonDocument& operator*() { return _pool._documents[_index]; }
+
+      private:
+        Lease(const Lease&);
+        Lease& operator=(const Lease&);
+
+        FitInfinityDocumentPool& _pool;
+        int _index;
+    };
+
+    // Leases refused because every document was in use
+    uint32_t exhausted() const {
+        return _exhausted.load(std::memory_order_relaxed);
+    }
+
+  private:
+    int acquire() {
+        uint32_t busy = _busy.load(std::memory_order_relaxed);
+        for (;;) {
+            int index = 0;
+            while (index < (int)N && (busy & (1UL << index))) {
+                index++;
+            }
+            if (index == (int)N) {
+                _exhausted.fetch_add(1, std::memory_order_relaxed);
+                return -1;
+            }
+            if (_busy.compare_exchange_weak(busy, busy | (1UL << index), std::memory_order_acquire)) {
+                _documents[index].clear();
+                return index;
+            }
+        }
+    }
+
+    void release(int index) {
+        _busy.fetch_and(~(1UL << index), std::memory_order_release);
+    }
+
+    StaticJsonDocument<Size> _documents[N];
+    std::atomic<uint32_t> _busy;        // bit per document currently leased
+    std::atomic<uint32_t> _exhausted;
+};
+
+#endif
@@ -1,12 +1,72 @@
 #include "FitInfinityMQTT.h"
 
+static const char DEVICE_TOPIC_ROOT[] = "fitinfinity/devices/";
+static const char BROADCAST_TOPIC_ROOT[] = "fitinfinity/system/broadcast/";
+
+// Bulk attendance packets: head (serialized fields plus the open array), records, tail
+static const char BULK_ENVELOPE_ARRAY[] = ",\"attendanceData\":[";
+static const char BULK_ENVELOPE_TAIL[] = "]}";
+
+// Appended to every topic when publishing MessagePack payloads
+static const char MSGPACK_TOPIC_SUFFIX[] = "/mp";
+
+// Retained state is republished this often while heartbeats have carried deltas
+static const unsigned long STATE_SNAPSHOT_REFRESH = 900000;
+
+// Threaded mode: how often the loop task copies the offline backlog for the metrics
+static const unsigned long OFFLINE_SNAPSHOT_INTERVAL = 1000;
+
+// Indexed by FitInfinityMQTT::TopicId
+static const char* const TOPIC_SUFFIXES[] = {
+    "",
+    "/enrollment/status",
+    "/enrollment/mode",
+    "/attendance/fingerprint",
+    "/attendance/rfid",
+    "/attendance/bulk",
+    "/status/heartbeat",
+    "/status/online",
+    "/status/error",
+    "/status/metrics",
+    "/status/reset",
+    "/ota/progress",
+    "/ota/status",
+    "/ota/capabilities",
+    "/ota/check",
+    "/ota/error",
+    "/config/wifi/request",
+    "/config/wifi/status",
+    "/enrollment/request",
+    "/enrollment/mode/switch",
+    "/attendance/ack",
+    "/attendance/offline/ack",
+    "/ota/available",
+    "/ota/download",
+    "/config/wifi/response",
+    "/config/wifi/scan",
+    "/commands/+"
+};
+
 FitInfinityMQTT::FitInfinityMQTT(const char* baseUrl, const char* deviceId, const char* accessKey)
     : FitInfinityAPI(baseUrl, deviceId, accessKey), mqttClient(wifiClient), deviceId(deviceId) {
     
     // Initialize variables
     lastHeartbeat = 0;
-    lastReconnectAttempt = 0;
+    heartbeatInterval = 30000;
+    publishedStateValid = false;
+    stateChangedSinceSnapshot = false;
+    lastStateSnapshot = 0;
+    heapDeltaThreshold = 8192;
+    rssiDeltaThreshold = 8;
+    temperatureDeltaThreshold = 3.0;
     reconnectAttempts = 0;
+    mqttBufferSize = MQTT_CLIENT_BUFFER_SIZE;
+    connectionState = MQTT_STATE_IDLE;
+    nextReconnectAt = 0;
+    reconnectBackoffBase = 1000;
+    reconnectBackoffMax = 60000;
+    tcpConnectTimeout = 2000;
+    subscribeStepIndex = 0;
     enrollmentMode = false;
     wifiConfigMode = false;
     
@@ -15,6 +75,19 @@ FitInfinityMQTT::FitInfinityMQTT(const char* baseUrl, const char* deviceId, cons
     firmwareUpdateCallback = nullptr;
     modeChangeCallback = nullptr;
     wifiConfigCallback = nullptr;
+    bulkChunkCallback = nullptr;
+    connectionStateCallback = nullptr;
+    
+    // Single-task mode until startNetworkTask() is called
+    networkTask = nullptr;
+    networkMutex = nullptr;
+    connectStepActive = false;
+    memset(&offlineSnapshot, 0, sizeof(offlineSnapshot));
+    offlineSnapshotAt = 0;
+    outboundDropped = 0;
+    
+    payloadEncoding = PAYLOAD_JSON;
+    publishOverflows = 0;
     
     // Set firmware version
     currentFirmwareVersion = "1.0.0";
@@ -22,14 +95,66 @@ FitInfinityMQTT::FitInfinityMQTT(const char* baseUrl, const char* deviceId, cons
     // Initialize config server and DNS server pointers
     configServer = nullptr;
     dnsServer = nullptr;
+    
+    // Routing table is populated on first subscription setup
+    // Outbox starts empty; spilled events are recovered on first connect
+    outboxHead = 0;
+    outboxCount = 0;
+    outboxInFlight = 0;
+    outboxNextSeq = 0;
+    outboxSeqReserved = 0;
+    outboxSpillRead = 0;
+    outboxSpillCount = 0;
+    outboxDropped = 0;
+    outboxRate = 200;
+    outboxWindow = 32;
+    outboxAckTimeout = 5000;
+    outboxLastDrain = 0;
+    outboxSentAt = 0;
+    outboxAcks = true;
+    outboxBatchRecords = 1;
+    outboxBatchDelay = 0;
+    outboxUnsentSince = 0;
+    outboxRestored = false;
+    
+    // Offline store drain stays with HTTP sync until enabled
+    offlineBatchHead = 0;
+    offlineBatchCount = 0;
+    offlineWindow = 4;
+    offlineBatchRecords = 50;
+    offlineAckTimeout = 10000;
+    offlineNext = 0;
+    offlineDrain = false;
+    
+    routeCount = 0;
+    routesBuilt = false;
+    resetDispatchStats();
+    
+    buildTopicTable();
+}
+
+bool FitInfinityMQTT::setMqttBufferSize(uint16_t bytes) {
+    // Larger packets mean fewer bulk chunks; also caps the largest inbound message
+    NetworkLock lock(networkMutex);
+    waitForConnectStep();
+    mqttBufferSize = bytes;
+    return mqttClient.setBufferSize(bytes);
 }
 
 bool FitInfinityMQTT::connectMQTT(const char* server, int port, const char* username, const char* password) {
+    NetworkLock lock(networkMutex);
+    waitForConnectStep();
     mqttServer = String(server);
     mqttPort = port;
     mqttUsername = String(username);
     mqttPassword = String(password);
     
+    buildTopicTable();
+    
+    if (!outboxRestored) {
+        restoreOutbox();
+    }
+    
     Serial.println("Connecting to MQTT broker...");
     Serial.println("Server: " + mqttServer + ":" + String(mqttPort));
     
@@ -38,169 +163,439 @@ bool FitInfinityMQTT::connectMQTT(const char* server, int port, const char* user
         this->handleMqttMessage(topic, payload, length);
     });
     
-    // Set client options
+    // Set client options; the socket timeout bounds the wait for CONNACK
+    if (!mqttClient.setBufferSize(mqttBufferSize)) {
+        Serial.println("Could not allocate MQTT buffer of " + String(mqttBufferSize) + " bytes");
+    }
     mqttClient.setKeepAlive(60);
-    mqttClient.setSocketTimeout(10);
+    mqttClient.setSocketTimeout(connackTimeoutSeconds());
+    
+    // The first attempt runs to completion so setup() can check the result;
+    // later attempts are spread across mqttLoop() calls
+    reconnectAttempts = 0;
+    setConnectionState(MQTT_STATE_RESOLVING);
+    while (connectionState != MQTT_STATE_CONNECTED && connectionState != MQTT_STATE_BACKOFF) {
+        advanceConnection();
+    }
     
-    return reconnectMQTT();
+    return isMQTTConnected();
 }
 
-bool FitInfinityMQTT::reconnectMQTT() {
-    if (mqttClient.connected()) {
-        return true;
+void FitInfinityMQTT::setConnectionState(MqttConnectionState state) {
+    if (state == connectionState) {
+        return;
     }
+    connectionState = state;
     
-    if (millis() - lastReconnectAttempt < 5000) {
-        return false; // Don't retry too frequently
+    if (connectionStateCallback) {
+        connectionStateCallback(state);
     }
+}
+
+void FitInfinityMQTT::scheduleReconnect() {
+    // Exponential backoff with equal jitter so a fleet does not reconnect in lockstep
+    // A shift that would overflow (a base of a minute or more) goes straight to the maximum
+    uint8_t exponent = min(reconnectAttempts, 16);
+    unsigned long ceiling = reconnectBackoffBase > (reconnectBackoffMax >> exponent) ? reconnectBackoffMax :
+                            reconnectBackoffBase << exponent;
+    unsigned long wait = ceiling / 2 + random(ceiling / 2 + 1);
     
-    lastReconnectAttempt = millis();
     reconnectAttempts++;
+    nextReconnectAt = millis() + wait;
     
-    String clientId = "FitInfinity-" + deviceId + "-" + String(random(0xffff), HEX);
-    
-    Serial.print("Attempting MQTT connection... ");
-    Serial.println("Client ID: " + clientId);
-    
-    if (mqttClient.connect(clientId.c_str(), mqttUsername.c_str(), mqttPassword.c_str())) {
-        Serial.println("MQTT connected!");
-        reconnectAttempts = 0;
-        
-        // Setup subscriptions
-        setupSubscriptions();
-        
-        // Publish online status
-        publishDeviceStatus("online");
-        publishDeviceMetrics();
-        
-        return true;
-    } else {
-        Serial.print("MQTT connection failed, rc=");
-        Serial.print(mqttClient.state());
-        Serial.println(" retrying in 5 seconds");
-        return false;
+    Serial.println("MQTT retry " + String(reconnectAttempts) + " in " + String(wait) + " ms");
+    setConnectionState(MQTT_STATE_BACKOFF);
+}
+
+void FitInfinityMQTT::advanceConnection() {
+    // Each call runs at most one step, and three of them still block: DNS (hostnames only,
+    // up to the core's resolver timeout), the TCP connect (up to tcpConnectTimeout) and
+    // CONNACK (up to connackTimeoutSeconds()). PubSubClient and WiFiClient have no
+    // non-blocking variants, so a single-task sketch can stall for that long per call
+    switch (connectionState) {
+        case MQTT_STATE_IDLE:
+            break;
+            
+        case MQTT_STATE_DISCONNECTED:
+            wifiClient.stop();
+            scheduleReconnect();
+            break;
+            
+        case MQTT_STATE_BACKOFF:
+            if ((long)(millis() - nextReconnectAt) >= 0) {
+                setConnectionState(MQTT_STATE_RESOLVING);
+            }
+            break;
+            
+        case MQTT_STATE_RESOLVING: {
+            // Literal addresses skip DNS; hostnames hit the resolver cache after the first lookup
+            if (WiFi.status() != WL_CONNECTED) {
+                scheduleReconnect();
+                break;
+            }
+            bool resolved = true;
+            if (!mqttServerIp.fromString(mqttServer.c_str())) {
+                NetworkUnlock unlock(networkMutex, connectStepActive);
+                resolved = WiFi.hostByName(mqttServer.c_str(), mqttServerIp) == 1;
+            }
+            if (connectionState != MQTT_STATE_RESOLVING) {
+                // disconnectMQTT() or connectMQTT() ran meanwhile and takes precedence
+                break;
+            }
+            if (resolved) {
+                setConnectionState(MQTT_STATE_TCP_CONNECTING);
+            } else {
+                Serial.println("MQTT broker lookup failed: " + mqttServer);
+                scheduleReconnect();
+            }
+            break;
+        }
+            
+        case MQTT_STATE_TCP_CONNECTING: {
+            bool connected;
+            {
+                NetworkUnlock unlock(networkMutex, connectStepActive);
+                connected = wifiClient.connect(mqttServerIp, mqttPort, tcpConnectTimeout);
+            }
+            if (connectionState != MQTT_STATE_TCP_CONNECTING) {
+                break;
+            }
+            if (connected) {
+                setConnectionState(MQTT_STATE_MQTT_CONNECTING);
+            } else {
+                Serial.println("MQTT TCP connect failed");
+                scheduleReconnect();
+            }
+            break;
+        }
+            
+        case MQTT_STATE_MQTT_CONNECTING: {
+            // The socket is already open, so this only sends CONNECT and waits for CONNACK
+            String clientId = "FitInfinity-" + deviceId + "-" + String(random(0xffff), HEX);
+            Serial.println("Attempting MQTT connection... Client ID: " + clientId);
+            
+            mqttClient.setServer(mqttServerIp, mqttPort);
+            bool connected;
+            {
+                NetworkUnlock unlock(networkMutex, connectStepActive);
+                connected = mqttClient.connect(clientId.c_str(), mqttUsername.c_str(), mqttPassword.c_str());
+            }
+            if (connectionState != MQTT_STATE_MQTT_CONNECTING) {
+                break;
+            }
+            if (connected) {
+                if (!routesBuilt) {
+                    buildRoutes();
+                }
+                subscribeStepIndex = 0;
+                setConnectionState(MQTT_STATE_SUBSCRIBING);
+            } else {
+                Serial.println("MQTT connection failed, rc=" + String(mqttClient.state()));
+                wifiClient.stop();
+                scheduleReconnect();
+            }
+            break;
+        }
+            
+        case MQTT_STATE_SUBSCRIBING:
+            if (!mqttClient.connected()) {
+                setConnectionState(MQTT_STATE_DISCONNECTED);
+            } else if (!subscribeStep(subscribeStepIndex++)) {
+                Serial.println("MQTT connected!");
+                reconnectAttempts = 0;
+                setConnectionState(MQTT_STATE_CONNECTED);
+                
+                // Publish online status; the retained snapshot only if it went stale
+                publishDeviceStatus("online");
+                refreshDeviceState();
+            }
+            break;
+            
+        case MQTT_STATE_CONNECTED:
+            if (!mqttClient.connected()) {
+                Serial.println("MQTT connection lost, rc=" + String(mqttClient.state()));
+                setConnectionState(MQTT_STATE_DISCONNECTED);
+            }
+            break;
     }
 }
 
 void FitInfinityMQTT::setupSubscriptions() {
-    String topicPrefix = getTopicPrefix();
+    if (!routesBuilt) {
+        buildRoutes();
+    }
     
-    // Subscribe to enrollment topics
-    mqttClient.subscribe((topicPrefix + "/enrollment/request").c_str());
-    mqttClient.subscribe((topicPrefix + "/enrollment/mode/switch").c_str());
+    for (uint8_t step = 0; subscribeStep(step); step++) {
+    }
     
-    // Subscribe to OTA topics
-    mqttClient.subscribe((topicPrefix + "/ota/available").c_str());
-    mqttClient.subscribe((topicPrefix + "/ota/download").c_str());
+    Serial.println("MQTT subscriptions setup complete");
+}
+
+bool FitInfinityMQTT::subscribeStep(uint8_t step, bool unsubscribe) {
+    // Enrollment, attendance acks, OTA, configuration and command topics
+    static const TopicId SUBSCRIBED_TOPICS[] = {
+        TOPIC_ENROLLMENT_REQUEST,
+        TOPIC_ENROLLMENT_MODE_SWITCH,
+        TOPIC_ATTENDANCE_ACK,
+        TOPIC_OFFLINE_ACK,
+        TOPIC_OTA_AVAILABLE,
+        TOPIC_OTA_DOWNLOAD,
+        TOPIC_WIFI_RESPONSE,
+        TOPIC_WIFI_SCAN,
+        TOPIC_COMMANDS
+    };
+    const uint8_t fixedCount = sizeof(SUBSCRIBED_TOPICS) / sizeof(SUBSCRIBED_TOPICS[0]);
+    if (step < fixedCount) {
+        if (unsubscribe) {
+            mqttClient.unsubscribe(topicFor(SUBSCRIBED_TOPICS[step]));
+        } else {
+            mqttClient.subscribe(topicFor(SUBSCRIBED_TOPICS[step]));
+        }
+        return true;
+    }
     
-    // Subscribe to configuration topics
-    mqttClient.subscribe((topicPrefix + "/config/wifi/response").c_str());
-    mqttClient.subscribe((topicPrefix + "/config/wifi/scan").c_str());
+    // System broadcasts, which do not depend on the device ID
+    if (step == fixedCount) {
+        if (!unsubscribe) {
+            mqttClient.subscribe("fitinfinity/system/broadcast/+");
+        }
+        return true;
+    }
     
-    // Subscribe to command topics
-    mqttClient.subscribe((topicPrefix + "/commands/+").c_str());
+    // Application routes, in registration order
+    uint8_t remaining = step - fixedCount - 1;
+    for (uint8_t i = 0; i < routeCount; i++) {
+        if (!routes[i].handler || routes[i].broadcast) {
+            continue;
+        }
+        if (remaining-- == 0) {
+            // The suffix keeps its trailing "+", which is already a valid filter
+            String topic = String(getTopicPrefix()) + routes[i].suffix;
+            if (unsubscribe) {
+                mqttClient.unsubscribe(topic.c_str());
+            } else {
+                mqttClient.subscribe(topic.c_str());
+            }
+            return true;
+        }
+    }
     
-    // Subscribe to system broadcasts
-    mqttClient.subscribe("fitinfinity/system/broadcast/+");
+    return false;
+}
+
+void FitInfinityMQTT::buildRoutes() {
+    addRoute("/enrollment/request", false, &FitInfinityMQTT::handleEnrollmentRequestMessage, nullptr);
+    addRoute("/enrollment/mode/switch", false, &FitInfinityMQTT::handleModeSwitchMessage, nullptr);
+    addRoute("/ota/available", false, &FitInfinityMQTT::handleOtaAvailableMessage, nullptr);
+    addRoute("/config/wifi/response", false, &FitInfinityMQTT::handleWifiResponseMessage, nullptr);
+    addRoute("/config/wifi/scan", false, &FitInfinityMQTT::handleWifiScanMessage, nullptr);
+    // Acks update the outbox, which the network task owns in threaded mode
+    addRoute("/attendance/ack", false, &FitInfinityMQTT::handleAttendanceAckMessage, nullptr, true);
+    // Offline acks move the store cursor, so they stay on the loop task with the drain
+    addRoute("/attendance/offline/ack", false, &FitInfinityMQTT::handleOfflineAckMessage, nullptr);
+    addRoute("+", true, &FitInfinityMQTT::handleBroadcastMessage, nullptr);
+    routesBuilt = true;
+}
+
+bool FitInfinityMQTT::addRoute(const char* suffix, bool broadcast,
+                               void (FitInfinityMQTT::*builtin)(const char*, JsonVariant),
+                               MqttTopicHandler handler, bool networkSide) {
+    size_t length = strlen(suffix);
+    if (routeCount >= MQTT_MAX_ROUTES || length >= MQTT_ROUTE_SUFFIX_SIZE) {
+        Serial.println("MQTT route table full or suffix too long, ignoring: " + String(suffix));
+        return false;
+    }
     
-    Serial.println("MQTT subscriptions setup complete");
+    // Copied, so callers may pass a temporary string. The slot is filled before the
+    // count covers it, so findRoute never sees a half-written route
+    MqttRoute& route = routes[routeCount];
+    route.wildcard = (length > 0 && suffix[length - 1] == '+');
+    memcpy(route.suffix, suffix, length + 1);
+    route.suffixLength = route.wildcard ? length - 1 : length;
+    route.hash = topicHash(suffix, route.suffixLength);
+    route.broadcast = broadcast;
+    route.builtin = builtin;
+    route.handler = handler;
+    route.networkSide = networkSide;
+    routeCount++;
+    return true;
 }
 
-void FitInfinityMQTT::handleMqttMessage(char* topic, byte* payload, unsigned int length) {
-    // Convert payload to string
-    String message = "";
-    for (unsigned int i = 0; i < length; i++) {
-        message += (char)payload[i];
+const FitInfinityMQTT::MqttRoute* FitInfinityMQTT::findRoute(const char* topic) {
+    // Strip the device or broadcast prefix without building any strings
+    const char* rest;
+    bool broadcast;
+    if (strncmp(topic, BROADCAST_TOPIC_ROOT, sizeof(BROADCAST_TOPIC_ROOT) - 1) == 0) {
+        rest = topic + sizeof(BROADCAST_TOPIC_ROOT) - 1;
+        broadcast = true;
+    } else if (topicPrefixLength > 0 && strncmp(topic, getTopicPrefix(), topicPrefixLength) == 0) {
+        rest = topic + topicPrefixLength;
+        broadcast = false;
+    } else {
+        return nullptr;
     }
     
-    String topicStr = String(topic);
-    Serial.println("MQTT Message received:");
-    Serial.println("Topic: " + topicStr);
-    Serial.println("Payload: " + message);
+    size_t restLength = strlen(rest);
+    uint32_t hash = topicHash(rest, restLength);
     
-    // Parse JSON payload
-    DynamicJsonDocument doc(1024);
-    DeserializationError error = deserializeJson(doc, message);
+    // Exact routes first, keyed by suffix hash
+    for (uint8_t i = 0; i < routeCount; i++) {
+        const MqttRoute& route = routes[i];
+        if (!route.wildcard && route.broadcast == broadcast && route.hash == hash &&
+            route.suffixLength == restLength && memcmp(route.suffix, rest, restLength) == 0) {
+            return &route;
+        }
+    }
+    
+    // Then single-level wildcard routes
+    for (uint8_t i = 0; i < routeCount; i++) {
+        const MqttRoute& route = routes[i];
+        if (route.wildcard && route.broadcast == broadcast && restLength >= route.suffixLength &&
+            memcmp(route.suffix, rest, route.suffixLength) == 0 &&
+            strchr(rest + route.suffixLength, '/') == nullptr) {
+            return &route;
+        }
+    }
+    
+    return nullptr;
+}
+
+uint32_t FitInfinityMQTT::topicHash(const char* str, size_t length) {
+    uint32_t hash = 2166136261UL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)str[i];
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+void FitInfinityMQTT::handleMqttMessage(char* topic, byte* payload, unsigned int length) {
+    const MqttRoute* route = findRoute(topic);
     
-    if (error) {
-        Serial.println("Failed to parse JSON message");
+    // In threaded mode application handlers run on the loop task; queue a copy for it
+    if (networkTask && route && !route->networkSide) {
+        queueInboundMessage(route, topic, payload, length);
         return;
     }
     
-    // Handle enrollment requests
-    if (topicStr.endsWith("/enrollment/request")) {
-        String employeeId = doc["employeeId"];
-        String employeeName = doc["employeeName"];
-        int fingerprintSlot = doc["fingerprintSlot"];
+    dispatchMessage(route, topic, (char*)payload, length);
+}
+
+void FitInfinityMQTT::dispatchMessage(const MqttRoute* route, const char* topic, char* payload, size_t length) {
+    unsigned long started = micros();
+    dispatchStats.messages++;
+    
+    if (!route) {
+        dispatchStats.unrouted++;
+    } else {
+        // Parse in place: strings in the document point into the payload buffer.
+        // Anything that does not start like JSON is taken as MessagePack
+        uint8_t first = length > 0 ? (uint8_t)payload[0] : 0;
+        bool json = (first == '{' || first == '[' || first == ' ' || first == '\r' || first == '\n');
+        DeserializationError error = json ? deserializeJson(inboundDoc, payload, length)
+                                          : deserializeMsgPack(inboundDoc, payload, length);
         
-        if (enrollmentCallback) {
-            enrollmentCallback(employeeId, employeeName, fingerprintSlot);
+        if (error) {
+            dispatchStats.parseErrors++;
+            Serial.println("Failed to parse message on " + String(topic));
+        } else if (route->handler) {
+            route->handler(topic, inboundDoc.as<JsonVariant>());
+        } else if (route->builtin) {
+            (this->*(route->builtin))(topic, inboundDoc.as<JsonVariant>());
         }
     }
-    // Handle enrollment mode switch
-    else if (topicStr.endsWith("/enrollment/mode/switch")) {
-        bool enabled = doc["enrollmentMode"];
-        enrollmentMode = enabled;
-        
-        if (modeChangeCallback) {
-            modeChangeCallback(enabled);
-        }
+    
+    unsigned long elapsed = micros() - started;
+    dispatchStats.totalMicros += elapsed;
+    if (elapsed > dispatchStats.maxMicros) {
+        dispatchStats.maxMicros = elapsed;
     }
-    // Handle OTA firmware updates
-    else if (topicStr.endsWith("/ota/available")) {
-        String version = doc["version"];
-        String downloadUrl = doc["downloadUrl"];
-        String checksum = doc["checksum"];
-        
-        if (firmwareUpdateCallback) {
-            firmwareUpdateCallback(version, downloadUrl, checksum);
-        }
+}
+
+// Handle enrollment requests
+void FitInfinityMQTT::handleEnrollmentRequestMessage(const char* topic, JsonVariant doc) {
+    String employeeId = doc["employeeId"];
+    String employeeName = doc["employeeName"];
+    int fingerprintSlot = doc["fingerprintSlot"];
+    
+    if (enrollmentCallback) {
+        enrollmentCallback(employeeId, employeeName, fingerprintSlot);
     }
-    // Handle WiFi configuration
-    else if (topicStr.endsWith("/config/wifi/response")) {
-        String ssid = doc["ssid"];
-        String password = doc["password"];
-        
-        if (wifiConfigCallback) {
-            wifiConfigCallback(ssid, password);
-        } else {
-            // Default WiFi configuration handling
-            handleWifiConfig(ssid, password);
-        }
+}
+
+// Handle enrollment mode switch
+void FitInfinityMQTT::handleModeSwitchMessage(const char* topic, JsonVariant doc) {
+    bool enabled = doc["enrollmentMode"];
+    enrollmentMode = enabled;
+    
+    if (modeChangeCallback) {
+        modeChangeCallback(enabled);
     }
-    // Handle WiFi scan requests
-    else if (topicStr.endsWith("/config/wifi/scan")) {
-        scanWifiNetworks();
+}
+
+// Handle OTA firmware updates
+void FitInfinityMQTT::handleOtaAvailableMessage(const char* topic, JsonVariant doc) {
+    String version = doc["version"];
+    String downloadUrl = doc["downloadUrl"];
+    String checksum = doc["checksum"];
+    
+    if (firmwareUpdateCallback) {
+        firmwareUpdateCallback(version, downloadUrl, checksum);
     }
-    // Handle system broadcasts
-    else if (topicStr.startsWith("fitinfinity/system/broadcast/")) {
-        String broadcastType = topicStr.substring(topicStr.lastIndexOf("/") + 1);
-        String broadcastMessage = doc["message"];
-        
-        Serial.println("System broadcast (" + broadcastType + "): " + broadcastMessage);
-        
-        // Handle maintenance mode
-        if (broadcastType == "maintenance") {
-            bool maintenanceMode = doc["data"]["enabled"];
-            if (maintenanceMode) {
-                Serial.println("Entering maintenance mode");
-                // Could display maintenance message on LCD
-            }
+}
+
+// Handle WiFi configuration
+void FitInfinityMQTT::handleWifiResponseMessage(const char* topic, JsonVariant doc) {
+    String ssid = doc["ssid"];
+    String password = doc["password"];
+    
+    if (wifiConfigCallback) {
+        wifiConfigCallback(ssid, password);
+    } else {
+        // Default WiFi configuration handling
+        handleWifiConfig(ssid, password);
+    }
+}
+
+// Handle WiFi scan requests
+void FitInfinityMQTT::handleWifiScanMessage(const char* topic, JsonVariant doc) {
+    scanWifiNetworks();
+}
+
+// Handle system broadcasts
+void FitInfinityMQTT::handleBroadcastMessage(const char* topic, JsonVariant doc) {
+    const char* broadcastType = strrchr(topic, '/') + 1;
+    const char* broadcastMessage = doc["message"] | "";
+    
+    Serial.println("System broadcast (" + String(broadcastType) + "): " + String(broadcastMessage));
+    
+    // Handle maintenance mode
+    if (strcmp(broadcastType, "maintenance") == 0) {
+        bool maintenanceMode = doc["data"]["enabled"];
+        if (maintenanceMode) {
+            Serial.println("Entering maintenance mode");
+            // Could display maintenance message on LCD
         }
     }
 }
 
 void FitInfinityMQTT::mqttLoop() {
-    if (!mqttClient.connected()) {
-        reconnectMQTT();
+    if (networkTask) {
+        // Networking runs on its own task; only deliver queued commands here
+        processInboundQueue();
     } else {
-        mqttClient.loop();
-        
-        // Send periodic heartbeat
-        if (millis() - lastHeartbeat > 30000) { // Every 30 seconds
-            sendHeartbeat();
-            lastHeartbeat = millis();
-        }
+        serviceNetwork();
+    }
+    
+    apiLoop();
+    drainOfflineStore();
+    
+    // The store belongs to this task; the network task's metrics read a copy
+    if (networkTask && millis() - offlineSnapshotAt >= OFFLINE_SNAPSHOT_INTERVAL) {
+        OfflineStats offline = getOfflineStats();
+        NetworkLock lock(networkMutex);
+        offlineSnapshot = offline;
+        offlineSnapshotAt = millis();
     }
     
     // Handle WiFi config server if active
@@ -212,15 +607,74 @@ void FitInfinityMQTT::mqttLoop() {
     }
 }
 
+void FitInfinityMQTT::serviceNetwork() {
+    if (connectionState != MQTT_STATE_CONNECTED || !mqttClient.connected()) {
+        // Anything unacknowledged is resent once the connection is back
+        outboxInFlight = 0;
+        advanceConnection();
+    } else {
+        mqttClient.loop();
+        drainOutbox();
+        
+        // Send periodic heartbeat
+        if (millis() - lastHeartbeat > heartbeatInterval) {
+            sendHeartbeat();
+            lastHeartbeat = millis();
+        }
+    }
+}
+
 bool FitInfinityMQTT::isMQTTConnected() {
+    // The state check comes first so callers never wait on a connect step
+    if (connectionState != MQTT_STATE_CONNECTED) {
+        return false;
+    }
+    NetworkLock lock(networkMutex);
     return mqttClient.connected();
 }
 
+void FitInfinityMQTT::waitForConnectStep() {
+    // Called with networkMutex held; the network task finishes its step without the lock
+    while (connectStepActive) {
+        vTaskDelay(pdMS_TO_TICKS(5));
+    }
+}
+
 void FitInfinityMQTT::disconnectMQTT() {
+    NetworkLock lock(networkMutex);
+    waitForConnectStep();
     if (mqttClient.connected()) {
         publishDeviceStatus("offline");
         mqttClient.disconnect();
     }
+    wifiClient.stop();
+    
+    // mqttLoop() reconnects from here, as before
+    reconnectAttempts = 0;
+    setConnectionState(MQTT_STATE_DISCONNECTED);
+}
+
+MqttConnectionState FitInfinityMQTT::getConnectionState() {
+    return connectionState;
+}
+
+void FitInfinityMQTT::setReconnectBackoff(unsigned long baseMs, unsigned long maxMs, unsigned long connectTimeoutMs) {
+    reconnectBackoffBase = baseMs > 0 ? baseMs : 1;
+    reconnectBackoffMax = max(maxMs, reconnectBackoffBase);
+    
+    // The same limit applies to the CONNACK wait, rounded up to PubSubClient's whole seconds
+    NetworkLock lock(networkMutex);
+    waitForConnectStep();
+    tcpConnectTimeout = connectTimeoutMs;
+    mqttClient.setSocketTimeout(connackTimeoutSeconds());
+}
+
+uint16_t FitInfinityMQTT::connackTimeoutSeconds() {
+    return (uint16_t)max(1UL, (tcpConnectTimeout + 999) / 1000);
+}
+
+void FitInfinityMQTT::onConnectionState(void (*callback)(MqttConnectionState state)) {
+    connectionStateCallback = callback;
 }
 
 // Callback registration
@@ -240,25 +694,64 @@ void FitInfinityMQTT::onWifiConfig(void (*callback)(String, String)) {
     wifiConfigCallback = callback;
 }
 
+bool FitInfinityMQTT::onTopic(const char* suffix, MqttTopicHandler handler) {
+    // The network task reads the table while routing, and may be building it
+    NetworkLock lock(networkMutex);
+    if (!addRoute(suffix, false, nullptr, handler)) {
+        return false;
+    }
+    
+    // Routes registered after connecting are subscribed right away
+    if (isMQTTConnected()) {
+        mqttClient.subscribe((String(getTopicPrefix()) + suffix).c_str());
+    }
+    return true;
+}
+
+bool FitInfinityMQTT::onBroadcast(const char* type, MqttTopicHandler handler) {
+    NetworkLock lock(networkMutex);
+    return addRoute(type, true, nullptr, handler);
+}
+
+MqttDispatchStats FitInfinityMQTT::getDispatchStats() {
+    return dispatchStats;
+}
+
+void FitInfinityMQTT::resetDispatchStats() {
+    memset(&dispatchStats, 0, sizeof(dispatchStats));
+}
+
+void FitInfinityMQTT::injectMessage(const char* topic, const char* payload, size_t length) {
+    // Same path as a message from the broker; copies because parsing is in place
+    char topicCopy[MQTT_INBOUND_TOPIC_SIZE];
+    byte payloadCopy[MQTT_INBOUND_PAYLOAD_SIZE];
+    if (strlen(topic) >= sizeof(topicCopy) || length > sizeof(payloadCopy)) {
+        dispatchStats.queueDrops++;
+        return;
+    }
+    strcpy(topicCopy, topic);
+    memcpy(payloadCopy, payload, length);
+    
+    NetworkLock lock(networkMutex);
+    handleMqttMessage(topicCopy, payloadCopy, length);
+}
+
 // Enrollment functions
 void FitInfinityMQTT::publishEnrollmentStatus(String employeeId, String status, int fingerprintId) {
-    if (!mqttClient.connected()) return;
+    if (!isMQTTConnected()) return;
     
-    DynamicJsonDocument doc(512);
-    doc["deviceId"] = deviceId;
+    DocumentLease lease(documentPool);
+    if (!lease) return;
+    JsonDocument& doc = *lease;
+    stampDocument(doc);
     doc["employeeId"] = employeeId;
     doc["status"] = status;
-    doc["timestamp"] = getTimestamp();
     
     if (fingerprintId >= 0) {
         doc["fingerprintId"] = fingerprintId;
     }
     
-    String payload;
-    serializeJson(doc, payload);
-    
-    String topic = getTopicPrefix() + "/enrollment/status";
-    mqttClient.publish(topic.c_str(), payload.c_str());
+    publishDocument(TOPIC_ENROLLMENT_STATUS, doc);
     
     Serial.println("Published enrollment status: " + status);
 }
@@ -266,57 +759,199 @@ void FitInfinityMQTT::publishEnrollmentStatus(String employeeId, String status,
 void FitInfinityMQTT::setEnrollmentMode(bool enabled) {
     enrollmentMode = enabled;
     
-    if (!mqttClient.connected()) return;
+    if (!isMQTTConnected()) return;
     
-    DynamicJsonDocument doc(256);
-    doc["deviceId"] = deviceId;
+    DocumentLease lease(documentPool);
+    if (!lease) return;
+    JsonDocument& doc = *lease;
+    stampDocument(doc);
     doc["enrollmentMode"] = enabled;
-    doc["timestamp"] = getTimestamp();
-    
-    String payload;
-    serializeJson(doc, payload);
     
-    String topic = getTopicPrefix() + "/enrollment/mode";
-    mqttClient.publish(topic.c_str(), payload.c_str());
+    publishDocument(TOPIC_ENROLLMENT_MODE, doc);
     
     Serial.println("Set enrollment mode: " + String(enabled ? "enabled" : "disabled"));
 }
 
 // Attendance functions
 void FitInfinityMQTT::publishAttendanceLog(String type, String id, String timestamp) {
-    if (!mqttClient.connected()) return;
+    // Held fingers and double taps never reach the outbox
+    if (isDuplicateScan(type.c_str(), id.c_str())) {
+        return;
+    }
     
-    DynamicJsonDocument doc(512);
-    doc["deviceId"] = deviceId;
-    doc["type"] = type;
-    doc["id"] = id;
-    doc["timestamp"] = timestamp;
-    doc["location"] = deviceId; // Device location identifier
+    // Threaded mode: hand the scan to the network task without blocking on it
+    if (networkTask) {
+        if (!queueOutboundEvent(type.c_str(), id.c_str(), timestamp.c_str())) {
+            Serial.println("Failed to queue " + type + " attendance: " + id);
+            return;
+        }
+        recordScan(type.c_str(), id.c_str());
+        return;
+    }
+    
+    // Queue first so the event survives a broker outage, then try to send it right away.
+    // Only a queued scan starts the duplicate window; a dropped one may be retried
+    if (!enqueueOutbox(type.c_str(), id.c_str(), timestamp.c_str())) {
+        Serial.println("Failed to queue " + type + " attendance: " + id);
+        return;
+    }
+    recordScan(type.c_str(), id.c_str());
+    
+    if (isMQTTConnected()) {
+        drainOutbox();
+    }
+}
+
+bool FitInfinityMQTT::publishBulkAttendanceData(JsonArray attendanceData) {
+    if (!isMQTTConnected()) return false;
     
-    String payload;
-    serializeJson(doc, payload);
+    NetworkLock lock(networkMutex);
+    size_t published = publishAttendanceChunks(attendanceData, false);
     
+    Serial.println("Published bulk attendance data: " + String(published) + "/" +
+                   String(attendanceData.size()) + " records");
+    return published == attendanceData.size();
+}
 
+size_t FitInfinityMQTT::publishAttendanceChunks(JsonArray records, bool stopOnFailure) {
+    bool binary = (payloadEncoding == PAYLOAD_MSGPACK);
+    char topic[MQTT_INBOUND_TOPIC_SIZE];
+    if (!formatPublishTopic(TOPIC_ATTENDANCE_BULK, topic, sizeof(topic))) {
+        return 0;
+    }
+    
+    // Payload room left in the client buffer after the fixed header, topic and envelope
+    char timestamp[25];
+    formatTimestamp(timestamp, sizeof(timestamp));
+    uint8_t head[160];
+    size_t packetLimit = mqttClient.getBufferSize() - (strlen(topic) + 7);
+    size_t envelope = formatChunkHead(head, sizeof(head), timestamp, 9999, 9999) +
+                      (binary ? 0 : sizeof(BULK_ENVELOPE_TAIL) - 1);
+    if (envelope == 0 || envelope >= packetLimit) {
+        Serial.println("MQTT buffer too small for bulk attendance");
+        return 0;
+    }
+    size_t budget = packetLimit - envelope;
+    
+    size_t published = 0;
+    int chunkIndex = 0;
+    JsonArray::iterator it = records.begin();
+    
+    while (it != records.end()) {
+        // Greedily take records until the next one would overflow the packet
+        JsonArray::iterator chunkStart = it;
+        size_t count = 0;
+        size_t bytes = 0;
+        while (it != records.end()) {
+            size_t length = binary ? measureMsgPack(*it) : measureJson(*it) + (count > 0 ? 1 : 0);
+            if (count > 0 && bytes + length > budget) {
+                break;
+            }
+            bytes += length;
+            count++;
+            ++it;
+        }
+        
+        bool success = (bytes <= budget) &&
+                       publishAttendanceChunk(topic, timestamp, chunkIndex, chunkStart, count, bytes);
+        if (!success && bytes > budget) {
+            Serial.println("Bulk attendance record too large for MQTT buffer, skipped");
+        }
+        
+        if (bulkChunkCallback) {
+            bulkChunkCallback(chunkIndex, count, success);
+        }
+        
+        if (success) {
+            published += count;
+        } else if (stopOnFailure) {
+            break;
+        }
+        chunkIndex++;
+    }
     
-    Serial.println("Published " + type + " attendance: " + id);
+    return published;
 }
 
-void FitInfinityMQTT::publishBulkAttendanceData(JsonArray attendanceData) {
-    if (!mqttClient.connected()) return;
+size_t FitInfinityMQTT::formatChunkHead(uint8_t* out, size_t size, const char* timestamp, int chunkIndex, size_t count) {
+    if (payloadEncoding == PAYLOAD_JSON) {
+        // Serialized so the device ID is escaped; the closing brace makes way for the array
+        StaticJsonDocument<JSON_OBJECT_SIZE(4)> doc;
+        doc["deviceId"] = deviceId.c_str();
+        doc["timestamp"] = timestamp;
+        doc["chunk"] = chunkIndex;
+        doc["count"] = (int)count;
+        size_t length = measureJson(doc) - 1;
+        if (length + sizeof(BULK_ENVELOPE_ARRAY) > size) {
+            return 0;
+        }
+        serializeJson(doc, (char*)out, size);
+        memcpy(out + length, BULK_ENVELOPE_ARRAY, sizeof(BULK_ENVELOPE_ARRAY) - 1);
+        return length + sizeof(BULK_ENVELOPE_ARRAY) - 1;
+    }
     
-    DynamicJsonDocument doc(2048);
-    doc["deviceId"] = deviceId;
-    doc["attendanceData"] = attendanceData;
-    doc["timestamp"] = getTimestamp();
-    doc["count"] = attendanceData.size();
+    // MessagePack {"ts": u32, "chunk": u16, "count": u16, "attendanceData": [array16 header]}
+    // with fixed-width integers so the head length never depends on the values
+    if (size < 45) {
+        return 0;
+    }
+    uint32_t epoch = (uint32_t)time(nullptr);
+    uint8_t* p = out;
+    *p++ = 0x84;
+    *p++ = 0xa2; memcpy(p, "ts", 2); p += 2;
+    *p++ = 0xce; *p++ = epoch >> 24; *p++ = epoch >> 16; *p++ = epoch >> 8; *p++ = epoch;
+    *p++ = 0xa5; memcpy(p, "chunk", 5); p += 5;
+    *p++ = 0xcd; *p++ = chunkIndex >> 8; *p++ = chunkIndex;
+    *p++ = 0xa5; memcpy(p, "count", 5); p += 5;
+    *p++ = 0xcd; *p++ = count >> 8; *p++ = count;
+    *p++ = 0xae; memcpy(p, "attendanceData", 14); p += 14;
+    *p++ = 0xdc; *p++ = count >> 8; *p++ = count;
+    return p - out;
+}
+
+bool FitInfinityMQTT::publishAttendanceChunk(const char* topic, const char* timestamp, int chunkIndex,
+                                             JsonArray::iterator records, size_t count, size_t recordBytes) {
+    bool binary = (payloadEncoding == PAYLOAD_MSGPACK);
+    uint8_t head[160];
+    size_t headLength = formatChunkHead(head, sizeof(head), timestamp, chunkIndex, count);
+    if (headLength == 0) {
+        return false;
+    }
     
-    String payload;
-    serializeJson(doc, payload);
+    size_t tailLength = binary ? 0 : sizeof(BULK_ENVELOPE_TAIL) - 1;
+    size_t total = headLength + recordBytes + tailLength;
+    if (!mqttClient.beginPublish(topic, total, false)) {
+        return false;
+    }
     
-    String topic = getTopicPrefix() + "/attendance/bulk";
-    mqttClient.publish(topic.c_str(), payload.c_str());
+    // Stream the records straight out; small ones are staged so each is a single write
+    uint8_t staging[256];
+    mqttClient.write(head, headLength);
+    for (size_t i = 0; i < count; i++, ++records) {
+        if (i > 0 && !binary) {
+            mqttClient.write((const uint8_t*)",", 1);
+        }
+        size_t length = binary ? measureMsgPack(*records) : measureJson(*records);
+        if (length < sizeof(staging)) {
+            if (binary) {
+                serializeMsgPack(*records, staging, sizeof(staging));
+            } else {
+                serializeJson(*records, (char*)staging, sizeof(staging));
+            }
+            mqttClient.write(staging, length);
+        } else if (binary) {
+            serializeMsgPack(*records, mqttClient);
+        } else {
+            serializeJson(*records, mqttClient);
+        }
+    }
+    mqttClient.write((const uint8_t*)BULK_ENVELOPE_TAIL, tailLength);
     
-    Serial.println("Published bulk attendance data: " + String(attendanceData.size()) + " records");
+    return mqttClient.endPublish() == 1;
+}
+
+void FitInfinityMQTT::onBulkChunk(void (*callback)(int, int, bool)) {
+    bulkChunkCallback = callback;
 }
 
 // Device management functions
@@ -325,83 +960,302 @@ void FitInfinityMQTT::publishHeartbeat() {
 }
 
 void FitInfinityMQTT::sendHeartbeat() {
-    if (!mqttClient.connected()) return;
+    if (!isMQTTConnected()) return;
     
-    DynamicJsonDocument doc(512);
-    doc["deviceId"] = deviceId;
-    doc["timestamp"] = getTimestamp();
+    DeviceStateSample current;
+    sampleDeviceState(current);
+    
+    // Identity changes and stale retained state get a full snapshot instead of a beat
+    unsigned long now = millis();
+    bool full = false;
+    if (!publishedStateValid || current.ipAddress != publishedState.ipAddress ||
+        (stateChangedSinceSnapshot && now - lastStateSnapshot > STATE_SNAPSHOT_REFRESH)) {
+        if (publishStateSnapshot()) {
+            return;
+        }
+        // The snapshot did not go out (no free document, or too large for the client
+        // buffer); a beat with every value keeps the device visible until it does
+        full = true;
+    }
+    
+    DocumentLease lease(documentPool);
+    if (!lease) return;
+    JsonDocument& doc = *lease;
+    stampDocument(doc);
     doc["uptime"] = getUptime();
-    doc["freeHeap"] = getFreeHeap();
-    doc["wifiRSSI"] = getSignalStrength();
     
-    String payload;
-    serializeJson(doc, payload);
+    // Only values that moved past their threshold since they were last published
+    bool heapMoved = full || abs((long)current.freeHeap - (long)publishedState.freeHeap) >= (long)heapDeltaThreshold;
+    bool rssiMoved = full || abs(current.rssi - publishedState.rssi) >= rssiDeltaThreshold;
+    bool temperatureMoved = full || fabs(current.temperature - publishedState.temperature) >= temperatureDeltaThreshold;
+    if (heapMoved) doc["freeHeap"] = current.freeHeap;
+    if (rssiMoved) doc["wifiRSSI"] = current.rssi;
+    if (temperatureMoved) doc["temperature"] = current.temperature;
+    
+    if (!publishDocument(TOPIC_STATUS_HEARTBEAT, doc)) {
+        return;
+    }
+    
+    if (heapMoved) publishedState.freeHeap = current.freeHeap;
+    if (rssiMoved) publishedState.rssi = current.rssi;
+    if (temperatureMoved) publishedState.temperature = current.temperature;
+    if (heapMoved || rssiMoved || temperatureMoved) {
+        stateChangedSinceSnapshot = true;
+    }
+}
+
+void FitInfinityMQTT::sampleDeviceState(DeviceStateSample& sample) {
+    sample.freeHeap = getFreeHeap();
+    sample.rssi = getSignalStrength();
+    sample.temperature = getTemperature();
+    sample.ipAddress = (uint32_t)WiFi.localIP();
+}
+
+void FitInfinityMQTT::refreshDeviceState() {
+    // The broker still holds the last retained snapshot across reconnects
+    DeviceStateSample current;
+    sampleDeviceState(current);
     
-    String topic = getTopicPrefix() + "/status/heartbeat";
-    mqttClient.publish(topic.c_str(), payload.c_str());
+    if (!publishedStateValid || stateChangedSinceSnapshot ||
+        current.ipAddress != publishedState.ipAddress ||
+        abs((long)current.freeHeap - (long)publishedState.freeHeap) >= (long)heapDeltaThreshold ||
+        abs(current.rssi - publishedState.rssi) >= rssiDeltaThreshold ||
+        fabs(current.temperature - publishedState.temperature) >= temperatureDeltaThreshold) {
+        publishDeviceMetrics();
+    }
+}
+
+void FitInfinityMQTT::setHeartbeatInterval(unsigned long intervalMs) {
+    heartbeatInterval = intervalMs;
+}
+
+void FitInfinityMQTT::setStateThresholds(uint32_t heapBytes, uint8_t rssiDbm, float temperatureC) {
+    heapDeltaThreshold = heapBytes;
+    rssiDeltaThreshold = rssiDbm;
+    temperatureDeltaThreshold = temperatureC;
 }
 
 void FitInfinityMQTT::publishDeviceStatus(String status) {
-    if (!mqttClient.connected()) return;
+    if (!isMQTTConnected()) return;
     
-    DynamicJsonDocument doc(512);
-    doc["deviceId"] = deviceId;
+    DocumentLease lease(documentPool);
+    if (!lease) return;
+    JsonDocument& doc = *lease;
+    stampDocument(doc);
     doc["status"] = status;
-    doc["timestamp"] = getTimestamp();
     doc["firmwareVersion"] = currentFirmwareVersion;
     doc["ipAddress"] = WiFi.localIP().toString();
+    doc["payloadEncoding"] = (payloadEncoding == PAYLOAD_MSGPACK) ? "msgpack" : "json";
     
-    String payload;
-    serializeJson(doc, payload);
-    
-    String topic = getTopicPrefix() + "/status/online";
-    mqttClient.publish(topic.c_str(), payload.c_str());
+    publishDocument(TOPIC_STATUS_ONLINE, doc);
     
     Serial.println("Published device status: " + status);
 }
 
 void FitInfinityMQTT::publishDeviceError(String error) {
-    if (!mqttClient.connected()) return;
+    if (!isMQTTConnected()) return;
     
-    DynamicJsonDocument doc(512);
-    doc["deviceId"] = deviceId;
+    DocumentLease lease(documentPool);
+    if (!lease) return;
+    JsonDocument& doc = *lease;
+    stampDocument(doc);
     doc["error"] = error;
-    doc["timestamp"] = getTimestamp();
-    doc["firmwareVersion"] = currentFirmwareVersion;
-    
-    String payload;
-    serializeJson(doc, payload);
+    if (payloadEncoding == PAYLOAD_JSON) {
+        doc["firmwareVersion"] = currentFirmwareVersion; // binary peers get it from status/online
+    }
     
-    String topic = getTopicPrefix() + "/status/error";
-    mqttClient.publish(topic.c_str(), payload.c_str());
+    publishDocument(TOPIC_STATUS_ERROR, doc);
     
     Serial.println("Published device error: " + error);
 }
 
 void FitInfinityMQTT::publishDeviceMetrics() {
-    if (!mqttClient.connected()) return;
+    publishStateSnapshot();
+}
+
+bool FitInfinityMQTT::publishStateSnapshot() {
+    if (!isMQTTConnected()) return false;
     
-    DynamicJsonDocument doc(1024);
-    doc["deviceId"] = deviceId;
-    doc["timestamp"] = getTimestamp();
+    DeviceStateSample current;
+    sampleDeviceState(current);
+    
+    DocumentLease lease(documentPool);
+    if (!lease) return false;
+    JsonDocument& doc = *lease;
+    stampDocument(doc);
     doc["metrics"]["uptime"] = getUptime();
-    doc["metrics"]["freeHeap"] = getFreeHeap();
-    doc["metrics"]["wifiRSSI"] = getSignalStrength();
-    doc["metrics"]["temperature"] = getTemperature();
+    doc["metrics"]["freeHeap"] = current.freeHeap;
+    doc["metrics"]["wifiRSSI"] = current.rssi;
+    doc["metrics"]["temperature"] = current.temperature;
     doc["metrics"]["firmwareVersion"] = currentFirmwareVersion;
     doc["metrics"]["wifiSSID"] = WiFi.SSID();
     doc["metrics"]["ipAddress"] = WiFi.localIP().toString();
+    doc["metrics"]["publishOverflows"] = getPublishOverflows();
+    doc["metrics"]["suppressedScans"] = getSuppressedScans();
+    ConnectionPoolStats connections = getConnectionStats();
+    doc["metrics"]["httpReused"] = connections.hits;
+    doc["metrics"]["httpHandshakes"] = connections.misses;
+    doc["metrics"]["httpConnectFailures"] = connections.failures;
     
-    String payload;
-    serializeJson(doc, payload);
+    // Backlog depth for the fleet dashboard, from the store's in-memory index
+    NetworkLock lock(networkMutex);
+    OfflineStats offline = networkTask ? offlineSnapshot : getOfflineStats();
+    JsonObject backlog = doc["metrics"].createNestedObject("offline");
+    backlog["pending"] = offline.pending;
+    backlog["oldest"] = offline.oldestEpoch;
+    backlog["newest"] = offline.newestEpoch;
+    backlog["bytes"] = offline.bytes;
+    backlog["drainRate"] = offline.drainRate;
+    backlog["delivered"] = offline.delivered;
     
-    String topic = getTopicPrefix() + "/status/metrics";
-    mqttClient.publish(topic.c_str(), payload.c_str());
+    // Retained full snapshot; heartbeats carry deltas against it
+    if (!publishDocument(TOPIC_STATUS_METRICS, doc, true)) {
+        return false;
+    }
+    publishedState = current;
+    publishedStateValid = true;
+    stateChangedSinceSnapshot = false;
+    lastStateSnapshot = millis();
+    return true;
 }
 
 // Helper functions
-String FitInfinityMQTT::getTopicPrefix() {
-    return "fitinfinity/devices/" + deviceId;
+void FitInfinityMQTT::stampDocument(JsonDocument& doc) {
+    // Binary payloads drop the device ID (it is in the topic) and use epoch seconds
+    if (payloadEncoding == PAYLOAD_MSGPACK) {
+        doc["ts"] = (uint32_t)time(nullptr);
+    } else {
+        char timestamp[25];
+        formatTimestamp(timestamp, sizeof(timestamp));
+        doc["deviceId"] = deviceId;
+        doc["timestamp"] = timestamp;
+    }
+}
+
+void FitInfinityMQTT::formatTimestamp(char* buffer, size_t size) {
+    // Same format as getTimestamp() without the String allocation
+    struct tm timeinfo;
+    buffer[0] = '\0';
+    if (getLocalTime(&timeinfo)) {
+        strftime(buffer, size, "%Y-%m-%dT%H:%M:%S.000Z", &timeinfo);
+    }
+}
+
+bool FitInfinityMQTT::formatPublishTopic(TopicId topic, char* buffer, size_t size) {
+    const char* suffix = (payloadEncoding == PAYLOAD_MSGPACK) ? MSGPACK_TOPIC_SUFFIX : "";
+    int length = snprintf(buffer, size, "%s%s", topicFor(topic), suffix);
+    return length > 0 && length < (int)size;
+}
+
+bool FitInfinityMQTT::publishDocument(TopicId topic, JsonDocument& doc, bool retained) {
+    // A document that ran out of room is missing fields; never publish it partially
+    if (doc.overflowed()) {
+        return reportPublishOverflow(topic, "document full");
+    }
+    
+    char topicName[MQTT_INBOUND_TOPIC_SIZE];
+    if (!formatPublishTopic(topic, topicName, sizeof(topicName))) {
+        return reportPublishOverflow(topic, "topic too long");
+    }
+    
+    bool binary = (payloadEncoding == PAYLOAD_MSGPACK);
+    size_t length = binary ? measureMsgPack(doc) : measureJson(doc);
+    if (length >= sizeof(publishBuffer)) {
+        return reportPublishOverflow(topic, "payload too large");
+    }
+    
+    // The buffer is shared by both tasks, so serialize and send under the lock
+    NetworkLock lock(networkMutex);
+    if (binary) {
+        serializeMsgPack(doc, publishBuffer, sizeof(publishBuffer));
+    } else {
+        serializeJson(doc, publishBuffer, sizeof(publishBuffer));
+    }
+    return mqttClient.publish(topicName, (const uint8_t*)publishBuffer, length, retained);
+}
+
+bool FitInfinityMQTT::reportPublishOverflow(TopicId topic, const char* reason) {
+    publishOverflows++;
+    Serial.print("Publish dropped (");
+    Serial.print(reason);
+    Serial.print("): ");
+    Serial.println(topicFor(topic));
+    return false;
+}
+
+uint32_t FitInfinityMQTT::getPublishOverflows() {
+    return publishOverflows + documentPool.exhausted();
+}
+
+void FitInfinityMQTT::setPayloadEncoding(PayloadEncoding encoding) {
+    payloadEncoding = encoding;
+}
+
+PayloadEncoding FitInfinityMQTT::getPayloadEncoding() {
+    return payloadEncoding;
+}
+
+const char* FitInfinityMQTT::getTopicPrefix() {
+    return topicFor(TOPIC_PREFIX);
+}
+
+const char* FitInfinityMQTT::topicFor(TopicId id) {
+    return topicTable + topicOffsets[id];
+}
+
+bool FitInfinityMQTT::buildTopicTable() {
+    static_assert(sizeof(TOPIC_SUFFIXES) / sizeof(TOPIC_SUFFIXES[0]) == TOPIC_COUNT,
+                  "TOPIC_SUFFIXES must match TopicId");
+    
+    // Each entry is "fitinfinity/devices/<deviceId><suffix>\0"
+    size_t prefixLength = sizeof(DEVICE_TOPIC_ROOT) - 1 + deviceId.length();
+    size_t offset = 0;
+    
+    for (uint8_t i = 0; i < TOPIC_COUNT; i++) {
+        size_t suffixLength = strlen(TOPIC_SUFFIXES[i]);
+        if (offset + prefixLength + suffixLength + 1 > sizeof(topicTable)) {
+            // Leave every remaining topic pointing at an empty string
+            Serial.println("MQTT topic table too small for device ID: " + deviceId);
+            topicTable[offset] = '\0';
+            for (uint8_t j = i; j < TOPIC_COUNT; j++) {
+                topicOffsets[j] = offset;
+            }
+            topicPrefixLength = (i > TOPIC_PREFIX) ? prefixLength : 0;
+            return false;
+        }
+        
+        topicOffsets[i] = offset;
+        memcpy(topicTable + offset, DEVICE_TOPIC_ROOT, sizeof(DEVICE_TOPIC_ROOT) - 1);
+        memcpy(topicTable + offset + sizeof(DEVICE_TOPIC_ROOT) - 1, deviceId.c_str(), deviceId.length());
+        memcpy(topicTable + offset + prefixLength, TOPIC_SUFFIXES[i], suffixLength + 1);
+        offset += prefixLength + suffixLength + 1;
+    }
+    
+    topicPrefixLength = prefixLength;
+    return true;
+}
+
+void FitInfinityMQTT::setDeviceId(const char* id) {
+    // HTTP requests carry the same ID
+    FitInfinityAPI::setDeviceId(id);
+    
+    // The network task reads the topic table, so it is rebuilt under the lock
+    NetworkLock lock(networkMutex);
+    
+    // The broker would otherwise keep delivering the old device's topics to this client
+    bool connected = isMQTTConnected();
+    if (connected) {
+        for (uint8_t step = 0; subscribeStep(step, true); step++) {
+        }
+    }
+    
+    deviceId = String(id);
+    buildTopicTable();
+    
+    // Move subscriptions over to the new device topics
+    if (connected) {
+        setupSubscriptions();
+    }
 }
 
 String FitInfinityMQTT::getDeviceInfo() {
@@ -425,6 +1279,7 @@ String FitInfinityMQTT::getFirmwareVersion() {
 
 void FitInfinityMQTT::setFirmwareVersion(String version) {
     currentFirmwareVersion = version;
+    publishedStateValid = false; // next heartbeat republishes the snapshot
 }
 
 float FitInfinityMQTT::getTemperature() {
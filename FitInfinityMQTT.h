@@ -2,6 +2,8 @@
 #define FitInfinityMQTT_h
 
 #include "FitInfinityAPI.h"
+#include "FitInfinityRing.h"
+#include "FitInfinityDocumentPool.h"
 #include <WiFiClient.h>
 #include <PubSubClient.h>
 #include <HTTPClient.h>
@@ -11,8 +13,140 @@
 #include <WebServer.h>
 #include <DNSServer.h>
 
+#ifndef MQTT_MAX_ROUTES
+#define MQTT_MAX_ROUTES 16
+#endif
+
+// Longest route suffix or broadcast type, including the terminator
+#ifndef MQTT_ROUTE_SUFFIX_SIZE
+#define MQTT_ROUTE_SUFFIX_SIZE 48
+#endif
+
+#ifndef MQTT_TOPIC_TABLE_SIZE
+#define MQTT_TOPIC_TABLE_SIZE 1536
+#endif
+
+#ifndef MQTT_OUTBOX_CAPACITY
+#define MQTT_OUTBOX_CAPACITY 64
+#endif
+
+#ifndef MQTT_OFFLINE_WINDOW
+#define MQTT_OFFLINE_WINDOW 8           // max offline batches awaiting ack
+#endif
+
+#ifndef MQTT_INBOUND_QUEUE_SIZE
+#define MQTT_INBOUND_QUEUE_SIZE 8       // power of two
+#endif
+
+#ifndef MQTT_OUTBOUND_QUEUE_SIZE
+#define MQTT_OUTBOUND_QUEUE_SIZE 32     // power of two
+#endif
+
+// PubSubClient packet buffer; bounds every publish, including bulk chunks (library default 256)
+#ifndef MQTT_CLIENT_BUFFER_SIZE
+#define MQTT_CLIENT_BUFFER_SIZE 2048
+#endif
+
+#ifndef MQTT_INBOUND_TOPIC_SIZE
+#define MQTT_INBOUND_TOPIC_SIZE 96
+#endif
+
+#ifndef MQTT_INBOUND_PAYLOAD_SIZE
+#define MQTT_INBOUND_PAYLOAD_SIZE 512
+#endif
+
+#ifndef MQTT_INBOUND_DOC_SIZE
+#define MQTT_INBOUND_DOC_SIZE 512
+#endif
+
+// Outbound documents are leased from a fixed pool and serialized into one shared buffer
+#ifndef MQTT_DOCUMENT_SIZE
+#define MQTT_DOCUMENT_SIZE 2048
+#endif
+
+#ifndef MQTT_DOCUMENT_POOL_SIZE
+#define MQTT_DOCUMENT_POOL_SIZE 3
+#endif
+
+#ifndef MQTT_PUBLISH_BUFFER_SIZE
+#define MQTT_PUBLISH_BUFFER_SIZE 2048
+#endif
+
+// Handler for a routed inbound message; payload points into the MQTT receive buffer
+typedef void (*MqttTopicHandler)(const char* topic, JsonVariant payload);
+
+// Inbound dispatch counters (timings in microseconds)
+struct MqttDispatchStats {
+    unsigned long messages;
+    unsigned long unrouted;
+    unsigned long parseErrors;
+    unsigned long totalMicros;
+    unsigned long maxMicros;
+    unsigned long queueDrops;   // threaded mode: inbound queue full
+};
+
+// MQTT connection progress, advanced one step per mqttLoop() call
+enum MqttConnectionState : uint8_t {
+    MQTT_STATE_IDLE,            // connectMQTT() not called yet
+    MQTT_STATE_DISCONNECTED,
+    MQTT_STATE_BACKOFF,         // waiting before the next attempt
+    MQTT_STATE_RESOLVING,
+    MQTT_STATE_TCP_CONNECTING,
+    MQTT_STATE_MQTT_CONNECTING,
+    MQTT_STATE_SUBSCRIBING,
+    MQTT_STATE_CONNECTED
+};
+
+// Wire format for published payloads
+enum PayloadEncoding : uint8_t {
+    PAYLOAD_JSON,               // JSON with deviceId and ISO timestamps
+    PAYLOAD_MSGPACK             // MessagePack on "<topic>/mp", epoch "ts", no deviceId
+};
+
+// Attendance event waiting in the outbox for a server acknowledgement
+struct OutboxEvent {
+    uint32_t seq;
+    char type[12];
+    char id[24];
+    char timestamp[25];
+};
+
 class FitInfinityMQTT : public FitInfinityAPI {
 private:
+    // Interned topics, in the same order as TOPIC_SUFFIXES in FitInfinityMQTT.cpp
+    enum TopicId : uint8_t {
+        TOPIC_PREFIX,
+        // Outbound
+        TOPIC_ENROLLMENT_STATUS,
+        TOPIC_ENROLLMENT_MODE,
+        TOPIC_ATTENDANCE_FINGERPRINT,
+        TOPIC_ATTENDANCE_RFID,
+        TOPIC_ATTENDANCE_BULK,
+        TOPIC_STATUS_HEARTBEAT,
+        TOPIC_STATUS_ONLINE,
+        TOPIC_STATUS_ERROR,
+        TOPIC_STATUS_METRICS,
+        TOPIC_STATUS_RESET,
+        TOPIC_OTA_PROGRESS,
+        TOPIC_OTA_STATUS,
+        TOPIC_OTA_CAPABILITIES,
+        TOPIC_OTA_CHECK,
+        TOPIC_OTA_ERROR,
+        TOPIC_WIFI_REQUEST,
+        TOPIC_WIFI_STATUS,
+        // Inbound
+        TOPIC_ENROLLMENT_REQUEST,
+        TOPIC_ENROLLMENT_MODE_SWITCH,
+        TOPIC_ATTENDANCE_ACK,
+        TOPIC_OFFLINE_ACK,
+        TOPIC_OTA_AVAILABLE,
+        TOPIC_OTA_DOWNLOAD,
+        TOPIC_WIFI_RESPONSE,
+        TOPIC_WIFI_SCAN,
+        TOPIC_COMMANDS,
+        TOPIC_COUNT
+    };
+    
     WiFiClient wifiClient;
     PubSubClient mqttClient;
     String deviceId;
@@ -20,6 +154,7 @@ private:
     int mqttPort;
     String mqttUsername;
     String mqttPassword;
+    uint16_t mqttBufferSize;
     
     // OTA Update components
     HTTPClient otaClient;
@@ -35,10 +170,155 @@ private:
     void (*firmwareUpdateCallback)(String version, String downloadUrl, String checksum);
     void (*modeChangeCallback)(bool enrollmentMode);
     void (*wifiConfigCallback)(String ssid, String password);
+    void (*bulkChunkCallback)(int chunkIndex, int recordCount, bool published);
+    void (*connectionStateCallback)(MqttConnectionState state);
+
+    // Full topic strings packed back to back, rebuilt when the device ID changes
+    char topicTable[MQTT_TOPIC_TABLE_SIZE];
+    uint16_t topicOffsets[TOPIC_COUNT];
+    uint16_t topicPrefixLength;
+    
+    // Inbound topic routing table
+    struct MqttRoute {
+        uint32_t hash;              // FNV-1a of the topic suffix
+        char suffix[MQTT_ROUTE_SUFFIX_SIZE];    // relative to the device prefix, or the broadcast type
+        uint8_t suffixLength;
+        bool broadcast;             // matches fitinfinity/system/broadcast/<suffix>
+        bool wildcard;              // suffix ends in "+" and matches any final level
+        bool networkSide;           // threaded mode: handled on the network task
+        void (FitInfinityMQTT::*builtin)(const char* topic, JsonVariant payload);
+        MqttTopicHandler handler;
+    };
+    MqttRoute routes[MQTT_MAX_ROUTES];
+    uint8_t routeCount;
+    bool routesBuilt;
+    StaticJsonDocument<MQTT_INBOUND_DOC_SIZE> inboundDoc;
+    MqttDispatchStats dispatchStats;
+    
+    PayloadEncoding payloadEncoding;
+    
+    // Outbound arena: no heap allocation on the publish paths
+    typedef FitInfinityDocumentPool<MQTT_DOCUMENT_SIZE, MQTT_DOCUMENT_POOL_SIZE> DocumentPool;
+    typedef DocumentPool::Lease DocumentLease;
+    DocumentPool documentPool;
+    char publishBuffer[MQTT_PUBLISH_BUFFER_SIZE];   // guarded by networkMutex
+    uint32_t publishOverflows;
+    
+    // Threaded mode: network task plus lock-free queues to the loop task
+    struct InboundMessage {
+        const MqttRoute* route;
+        uint16_t length;
+        char topic[MQTT_INBOUND_TOPIC_SIZE];
+        char payload[MQTT_INBOUND_PAYLOAD_SIZE];
+    };
+    TaskHandle_t networkTask;
+    SemaphoreHandle_t networkMutex;     // recursive; guards mqttClient across tasks
+    volatile bool connectStepActive;    // a DNS, TCP or CONNACK wait runs without networkMutex
+    FitInfinityRing<InboundMessage, MQTT_INBOUND_QUEUE_SIZE> inboundQueue;
+    FitInfinityRing<OutboxEvent, MQTT_OUTBOUND_QUEUE_SIZE> outboundQueue;
+    uint32_t outboundDropped;
+    
+    // Holds networkMutex for a scope; does nothing in single-task mode
+    class NetworkLock {
+      public:
+        explicit NetworkLock(SemaphoreHandle_t mutex) : _mutex(mutex) {
+            if (_mutex) xSemaphoreTakeRecursive(_mutex, portMAX_DELAY);
+        }
+        ~NetworkLock() {
+            if (_mutex) xSemaphoreGiveRecursive(_mutex);
+        }
+      private:
+        SemaphoreHandle_t _mutex;
+    };
+    
+    // Gives networkMutex back for a blocking connect step, so publishes from the loop task
+    // fail fast instead of waiting out DNS, TCP connect or CONNACK; takes it again after
+    class NetworkUnlock {
+      public:
+        NetworkUnlock(SemaphoreHandle_t mutex, volatile bool& active) : _mutex(mutex), _active(active) {
+            if (_mutex) {
+                _active = true;
+                xSemaphoreGiveRecursive(_mutex);
+            }
+        }
+        ~NetworkUnlock() {
+            if (_mutex) {
+                _active = false;
+                xSemaphoreTakeRecursive(_mutex, portMAX_DELAY);
+            }
+        }
+      private:
+        SemaphoreHandle_t _mutex;
+        volatile bool& _active;
+    };
+    void waitForConnectStep();
+    
+    // Attendance outbox: RAM ring of unacknowledged events, overflow spilled to SD or flash.
+    // ESP.restart() writes the ring to the spill file as well; a power cut, brownout or
+    // watchdog reset skips that, losing up to MQTT_OUTBOX_CAPACITY events in the ring plus
+    // MQTT_OUTBOUND_QUEUE_SIZE scans not yet handed to the network task
+    OutboxEvent outbox[MQTT_OUTBOX_CAPACITY];
+    uint16_t outboxHead;            // oldest unacknowledged event
+    uint16_t outboxCount;           // events held in the ring
+    uint16_t outboxInFlight;        // events from head published and awaiting ack
+    uint32_t outboxNextSeq;
+    uint32_t outboxSeqReserved;     // first sequence number not yet persisted
+    uint32_t outboxSpillRead;       // next spilled event to load into the ring
+    uint32_t outboxSpillCount;      // events written to the spill file
+    uint32_t outboxDropped;
+    uint16_t outboxRate;            // events per second
+    uint16_t outboxWindow;          // max events in flight
+    unsigned long outboxAckTimeout;
+    unsigned long outboxLastDrain;
+    unsigned long outboxSentAt;     // when the oldest in-flight event was published
+    bool outboxAcks;
+    uint8_t outboxBatchRecords;     // flush a batch at this many records...
+    unsigned long outboxBatchDelay; // ...or once the oldest unsent event is this old
+    unsigned long outboxUnsentSince;
+    bool outboxRestored;
+    static FitInfinityMQTT* shutdownOutbox;     // instance whose ring is saved on restart
+    
+    // Offline store drain: batches keyed by record range, released by cumulative server acks
+    struct OfflineBatch {
+        uint32_t end;               // one past the last record index in the batch
+        unsigned long sentAt;
+    };
+    OfflineBatch offlineBatches[MQTT_OFFLINE_WINDOW];
+    uint8_t offlineBatchHead;       // oldest unacknowledged batch
+    uint8_t offlineBatchCount;      // batches published and awaiting ack
+    uint8_t offlineWindow;          // max batches in flight
+    uint16_t offlineBatchRecords;
+    unsigned long offlineAckTimeout;
+    uint32_t offlineNext;           // first record index not yet published
+    bool offlineDrain;
 
+    // Device state: retained snapshot on status/metrics, threshold deltas on heartbeats
+    struct DeviceStateSample {
+        uint32_t freeHeap;
+        int rssi;
+        float temperature;
+        uint32_t ipAddress;
+    };
+    DeviceStateSample publishedState;   // values carried by the retained snapshot plus deltas
+    bool publishedStateValid;           // false until a snapshot went out this boot
+    bool stateChangedSinceSnapshot;
+    unsigned long lastStateSnapshot;
+    unsigned long heartbeatInterval;
+    uint32_t heapDeltaThreshold;
+    uint8_t rssiDeltaThreshold;
+    float temperatureDeltaThreshold;
+    OfflineStats offlineSnapshot;       // threaded mode: copied on the loop task, guarded by networkMutex
+    unsigned long offlineSnapshotAt;
+    
     // Internal state
     unsigned long lastHeartbeat;
-    unsigned long lastReconnectAttempt;
+    MqttConnectionState connectionState;
+    unsigned long nextReconnectAt;
+    unsigned long reconnectBackoffBase;
+    unsigned long reconnectBackoffMax;
+    unsigned long tcpConnectTimeout;
+    IPAddress mqttServerIp;
+    uint8_t subscribeStepIndex;
     int reconnectAttempts;
     bool enrollmentMode;
 
@@ -47,9 +327,16 @@ public:
     
     // MQTT Connection Management
     bool connectMQTT(const char* server, int port, const char* username, const char* password);
+    void setDeviceId(const char* id);
+    bool setMqttBufferSize(uint16_t bytes);
     void mqttLoop();
+    bool startNetworkTask(BaseType_t core = 0, uint32_t stackSize = 8192, UBaseType_t priority = 1);
+    bool isNetworkTaskRunning();
     bool isMQTTConnected();
     void disconnectMQTT();
+    MqttConnectionState getConnectionState();
+    void setReconnectBackoff(unsigned long baseMs, unsigned long maxMs, unsigned long connectTimeoutMs = 2000);
+    void onConnectionState(void (*callback)(MqttConnectionState state));
     
     // WiFi Management
     bool loadWifiCredentials(String& ssid, String& password);
@@ -69,6 +356,13 @@ public:
     void onFirmwareUpdate(void (*callback)(String, String, String));
     void onModeChange(void (*callback)(bool));
     void onWifiConfig(void (*callback)(String, String));
+    bool onTopic(const char* suffix, MqttTopicHandler handler);
+    bool onBroadcast(const char* type, MqttTopicHandler handler);
+    
+    // Dispatch diagnostics
+    MqttDispatchStats getDispatchStats();
+    void resetDispatchStats();
+    void injectMessage(const char* topic, const char* payload, size_t length);
     
     // Enrollment via MQTT
     void publishEnrollmentStatus(String employeeId, String status, int fingerprintId = -1);
@@ -76,7 +370,20 @@ public:
     
     // Real-time Attendance
     void publishAttendanceLog(String type, String id, String timestamp);
-    void publishBulkAttendanceData(JsonArray attendanceData);
+    bool publishBulkAttendanceData(JsonArray attendanceData);
+    void onBulkChunk(void (*callback)(int chunkIndex, int recordCount, bool published));
+    
+    // Attendance outbox
+    void setOutboxRate(uint16_t eventsPerSecond, uint16_t window = 32, unsigned long ackTimeoutMs = 5000);
+    void setOutboxAcks(bool enabled);
+    void setAttendanceBatching(uint8_t maxRecords, unsigned long maxDelayMs);
+    uint32_t getOutboxPending();
+    uint32_t getOutboxDropped();
+    
+    // Offline store drain over MQTT
+    void setOfflineDrain(bool enabled, uint8_t window = 4, uint16_t batchRecords = 50,
+                         unsigned long ackTimeoutMs = 10000);
+    uint32_t getOfflineInFlight();
     
     // OTA Update System
     bool downloadAndInstallFirmware(String firmwareUrl, String version, String checksum);
@@ -88,11 +395,18 @@ public:
     void checkForFirmwareUpdates();
     void handleOTAError(String error, int errorCode);
     
+    // Payload encoding
+    void setPayloadEncoding(PayloadEncoding encoding);
+    PayloadEncoding getPayloadEncoding();
+    uint32_t getPublishOverflows();
+    
     // Device Management
     void publishHeartbeat();
     void publishDeviceStatus(String status);
     void publishDeviceError(String error);
     void publishDeviceMetrics();
+    void setHeartbeatInterval(unsigned long intervalMs);
+    void setStateThresholds(uint32_t heapBytes, uint8_t rssiDbm, float temperatureC);
     
     // System Information
     String getDeviceInfo();
@@ -104,11 +418,72 @@ public:
     int getFreeHeap();
     
 private:
-    String getTopicPrefix();
+    const char* getTopicPrefix();
+    const char* topicFor(TopicId id);
+    bool buildTopicTable();
     void setupSubscriptions();
+    bool subscribeStep(uint8_t step, bool unsubscribe = false);
     void handleMqttMessage(char* topic, byte* payload, unsigned int length);
-    bool reconnectMQTT();
+    void dispatchMessage(const MqttRoute* route, const char* topic, char* payload, size_t length);
+    bool publishDocument(TopicId topic, JsonDocument& doc, bool retained = false);
+    void stampDocument(JsonDocument& doc);
+    void formatTimestamp(char* buffer, size_t size);
+    bool reportPublishOverflow(TopicId topic, const char* reason);
+    bool formatPublishTopic(TopicId topic, char* buffer, size_t size);
+    
+    // Network servicing, on the loop task or the network task
+    void serviceNetwork();
+    static void networkTaskEntry(void* arg);
+    void queueInboundMessage(const MqttRoute* route, const char* topic, const byte* payload, unsigned int length);
+    void processInboundQueue();
+    bool queueOutboundEvent(const char* type, const char* id, const char* timestamp);
+    bool addRoute(const char* suffix, bool broadcast,
+                  void (FitInfinityMQTT::*builtin)(const char*, JsonVariant),
+                  MqttTopicHandler handler, bool networkSide = false);
+    void buildRoutes();
+    const MqttRoute* findRoute(const char* topic);
+    static uint32_t topicHash(const char* str, size_t length);
+    
+    // Built-in topic handlers
+    void handleEnrollmentRequestMessage(const char* topic, JsonVariant payload);
+    void handleModeSwitchMessage(const char* topic, JsonVariant payload);
+    void handleOtaAvailableMessage(const char* topic, JsonVariant payload);
+    void handleWifiResponseMessage(const char* topic, JsonVariant payload);
+    void handleWifiScanMessage(const char* topic, JsonVariant payload);
+    void handleBroadcastMessage(const char* topic, JsonVariant payload);
+    void handleAttendanceAckMessage(const char* topic, JsonVariant payload);
+    void handleOfflineAckMessage(const char* topic, JsonVariant payload);
+    
+    // Outbox internals
+    void restoreOutbox();
+    bool enqueueOutbox(const char* type, const char* id, const char* timestamp);
+    void drainOutbox();
+    size_t drainOutboxBatch(size_t limit);
+    bool publishOutboxEvent(const OutboxEvent& event);
+    void acknowledgeOutbox(uint32_t seq);
+    bool spillOutboxEvent(const OutboxEvent& event);
+    fs::FS& outboxFileSystem();
+    void loadSpilledEvents();
+    void spillOutbox();
+    static void spillOutboxOnShutdown();
+    uint32_t nextOutboxSeq();
+    void drainOfflineStore();
+    bool publishOfflineBatch(uint32_t start, uint32_t& end);
+    uint16_t fillOfflineBatch(JsonDocument& doc, uint32_t start, uint16_t limit, uint16_t skip,
+                              size_t budget, uint32_t& end, uint16_t& skipped);
+    void acknowledgeOfflineBatches(uint32_t end);
+    void advanceConnection();
+    uint16_t connackTimeoutSeconds();
+    void scheduleReconnect();
+    void setConnectionState(MqttConnectionState state);
+    size_t publishAttendanceChunks(JsonArray records, bool stopOnFailure);
+    size_t formatChunkHead(uint8_t* out, size_t size, const char* timestamp, int chunkIndex, size_t count);
+    bool publishAttendanceChunk(const char* topic, const char* timestamp, int chunkIndex,
+                                JsonArray::iterator records, size_t count, size_t recordBytes);
     void sendHeartbeat();
+    void sampleDeviceState(DeviceStateSample& sample);
+    void refreshDeviceState();
+    bool publishStateSnapshot();
     bool verifyFirmwareSignature(const uint8_t* firmware, size_t size);
     void resetToFactoryDefaults();
     
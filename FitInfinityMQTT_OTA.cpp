@@ -11,9 +11,20 @@ bool FitInfinityMQTT::downloadAndInstallFirmware(String firmwareUrl, String vers
     publishUpdateProgress(0);
     publishUpdateStatus("downloading", "");
     
-    // Initialize HTTP client
+    // Initialize HTTP client; a firmware host that is also the API host skips the handshake.
+    // Async attendance requests wait for the download to finish.
+    HttpLock lock(_httpMutex);
     HTTPClient http;
-    http.begin(firmwareUrl);
+    WiFiClient* transport = _connections.acquire(firmwareUrl, HTTP_CONNECT_TIMEOUT);
+    if (!transport) {
+        String error = _connections.holdRemaining() > 0 ? "Connection held back by the startup jitter" :
+                       "Could not connect to firmware server";
+        Serial.println(error);
+        publishUpdateStatus("failed", error);
+        return false;
+    }
+    http.setReuse(true);
+    http.begin(*transport, firmwareUrl);
     http.setTimeout(30000); // 30 second timeout
     
     // Add headers
@@ -91,8 +102,8 @@ bool FitInfinityMQTT::downloadAndInstallFirmware(String firmwareUrl, String vers
             delay(10);
         }
         
-        // Keep MQTT alive during download
-        if (mqttClient.connected()) {
+        // Keep MQTT alive during download (the network task does this in threaded mode)
+        if (!networkTask && mqttClient.connected()) {
             mqttClient.loop();
         }
     }
@@ -148,30 +159,30 @@ bool FitInfinityMQTT::downloadAndInstallFirmware(String firmwareUrl, String vers
 }
 
 void FitInfinityMQTT::publishUpdateProgress(int progress) {
-    if (!mqttClient.connected()) return;
+    if (!isMQTTConnected()) return;
     
-    DynamicJsonDocument doc(256);
-    doc["deviceId"] = deviceId;
+    DocumentLease lease(documentPool);
+    if (!lease) return;
+    JsonDocument& doc = *lease;
+    stampDocument(doc);
     doc["progress"] = progress;
-    doc["timestamp"] = getTimestamp();
-    
-    String payload;
-    serializeJson(doc, payload);
     
-    String topic = getTopicPrefix() + "/ota/progress";
-    mqttClient.publish(topic.c_str(), payload.c_str());
+    publishDocument(TOPIC_OTA_PROGRESS, doc);
     
     Serial.println("OTA Progress: " + String(progress) + "%");
 }
 
 void FitInfinityMQTT::publishUpdateStatus(String status, String error) {
-    if (!mqttClient.connected()) return;
+    if (!isMQTTConnected()) return;
     
-    DynamicJsonDocument doc(512);
-    doc["deviceId"] = deviceId;
+    DocumentLease lease(documentPool);
+    if (!lease) return;
+    JsonDocument& doc = *lease;
+    stampDocument(doc);
     doc["status"] = status;
-    doc["timestamp"] = getTimestamp();
-    doc["firmwareVersion"] = currentFirmwareVersion;
+    if (payloadEncoding == PAYLOAD_JSON) {
+        doc["firmwareVersion"] = currentFirmwareVersion; // binary peers get it from status/online
+    }
     
     if (!error.isEmpty()) {
         doc["error"] = error;
@@ -182,11 +193,7 @@ void FitInfinityMQTT::publishUpdateStatus(String status, String error) {
     doc["chipModel"] = ESP.getChipModel();
     doc["flashSize"] = ESP.getFlashChipSize();
     
-    String payload;
-    serializeJson(doc, payload);
-    
-    String topic = getTopicPrefix() + "/ota/status";
-    mqttClient.publish(topic.c_str(), payload.c_str());
+    publishDocument(TOPIC_OTA_STATUS, doc);
     
     Serial.println("Published OTA status: " + status);
     if (!error.isEmpty()) {
@@ -273,17 +280,13 @@ void FitInfinityMQTT::resetToFactoryDefaults() {
     preferences.end();
     
     // Publish reset status
-    if (mqttClient.connected()) {
-        DynamicJsonDocument doc(256);
-        doc["deviceId"] = deviceId;
+    DocumentLease lease(documentPool);
+    if (isMQTTConnected() && lease) {
+        JsonDocument& doc = *lease;
+        stampDocument(doc);
         doc["action"] = "factory_reset";
-        doc["timestamp"] = getTimestamp();
-        
-        String payload;
-        serializeJson(doc, payload);
         
-        String topic = getTopicPrefix() + "/status/reset";
-        mqttClient.publish(topic.c_str(), payload.c_str());
+        publishDocument(TOPIC_STATUS_RESET, doc);
     }
     
     Serial.println("Factory reset completed, restarting...");
@@ -309,41 +312,39 @@ String FitInfinityMQTT::getOTAStatus() {
 }
 
 void FitInfinityMQTT::publishOTACapabilities() {
-    if (!mqttClient.connected()) return;
+    if (!isMQTTConnected()) return;
     
-    DynamicJsonDocument doc(512);
-    doc["deviceId"] = deviceId;
+    DocumentLease lease(documentPool);
+    if (!lease) return;
+    JsonDocument& doc = *lease;
+    stampDocument(doc);
     doc["capabilities"]["ota"] = true;
     doc["capabilities"]["maxFirmwareSize"] = ESP.getFreeSketchSpace();
     doc["capabilities"]["checksumValidation"] = true;
     doc["capabilities"]["progressReporting"] = true;
     doc["capabilities"]["rollback"] = false; // Not implemented yet
+    JsonArray encodings = doc["capabilities"].createNestedArray("payloadEncodings");
+    encodings.add("json");
+    encodings.add("msgpack");
+    doc["payloadEncoding"] = (payloadEncoding == PAYLOAD_MSGPACK) ? "msgpack" : "json";
     doc["currentVersion"] = currentFirmwareVersion;
-    doc["timestamp"] = getTimestamp();
     
-    String payload;
-    serializeJson(doc, payload);
-    
-    String topic = getTopicPrefix() + "/ota/capabilities";
-    mqttClient.publish(topic.c_str(), payload.c_str());
+    publishDocument(TOPIC_OTA_CAPABILITIES, doc);
     
     Serial.println("Published OTA capabilities");
 }
 
 void FitInfinityMQTT::checkForFirmwareUpdates() {
-    if (!mqttClient.connected()) return;
+    if (!isMQTTConnected()) return;
     
-    DynamicJsonDocument doc(256);
-    doc["deviceId"] = deviceId;
+    DocumentLease lease(documentPool);
+    if (!lease) return;
+    JsonDocument& doc = *lease;
+    stampDocument(doc);
     doc["currentVersion"] = currentFirmwareVersion;
     doc["requestUpdate"] = true;
-    doc["timestamp"] = getTimestamp();
     
-    String payload;
-    serializeJson(doc, payload);
-    
-    String topic = getTopicPrefix() + "/ota/check";
-    mqttClient.publish(topic.c_str(), payload.c_str());
+    publishDocument(TOPIC_OTA_CHECK, doc);
     
     Serial.println("Requested firmware update check");
 }
@@ -352,20 +353,19 @@ void FitInfinityMQTT::checkForFirmwareUpdates() {
 void FitInfinityMQTT::handleOTAError(String error, int errorCode) {
     Serial.println("OTA Error: " + error + " (Code: " + String(errorCode) + ")");
     
-    if (!mqttClient.connected()) return;
+    if (!isMQTTConnected()) return;
     
-    DynamicJsonDocument doc(512);
-    doc["deviceId"] = deviceId;
+    DocumentLease lease(documentPool);
+    if (!lease) return;
+    JsonDocument& doc = *lease;
+    stampDocument(doc);
     doc["error"] = error;
     doc["errorCode"] = errorCode;
-    doc["timestamp"] = getTimestamp();
-    doc["firmwareVersion"] = currentFirmwareVersion;
+    if (payloadEncoding == PAYLOAD_JSON) {
+        doc["firmwareVersion"] = currentFirmwareVersion; // binary peers get it from status/online
+    }
     doc["freeHeap"] = ESP.getFreeHeap();
     doc["updateError"] = Update.errorString();
     
-    String payload;
-    serializeJson(doc, payload);
-    
-    String topic = getTopicPrefix() + "/ota/error";
-    mqttClient.publish(topic.c_str(), payload.c_str());
+    publishDocument(TOPIC_OTA_ERROR, doc);
 }
\ No newline at end of file
@@ -0,0 +1,199 @@
+#include "FitInfinityMQTT.h"
+
+// Offline Store Drain Functions
+
+// Headroom for "to" and "count", which are filled in after the records are added
+static const size_t OFFLINE_BATCH_TRAILER = 16;
+
+void FitInfinityMQTT::setOfflineDrain(bool enabled, uint8_t window, uint16_t batchRecords,
+                                      unsigned long ackTimeoutMs) {
+    offlineDrain = enabled;
+    offlineWindow = constrain(window, 1, MQTT_OFFLINE_WINDOW);
+    offlineBatchRecords = batchRecords > 0 ? batchRecords : 1;
+    offlineAckTimeout = ackTimeoutMs;
+    
+    // Start over from the store cursor with the new settings
+    offlineBatchCount = 0;
+}
+
+uint32_t FitInfinityMQTT::getOfflineInFlight() {
+    return offlineBatchCount > 0 ? offlineNext - _offlineStore.head() : 0;
+}
+
+void FitInfinityMQTT::drainOfflineStore() {
+    if (!offlineDrain || !_offlineStore.isReady()) {
+        return;
+    }
+    
+    // Anything unacknowledged is resent once the connection is back
+    if (!isMQTTConnected()) {
+        offlineBatchCount = 0;
+        return;
+    }
+    
+    unsigned long now = millis();
+    uint32_t head = _offlineStore.head();
+    
+    // An HTTP sync may have committed part of the window already
+    acknowledgeOfflineBatches(head);
+    
+    // No ack for the oldest batch in time: go back to the cursor and resend the window
+    if (offlineBatchCount > 0 && now - offlineBatches[offlineBatchHead].sentAt > offlineAckTimeout) {
+        Serial.println("Offline batch ack timeout, resending from record " + String(head));
+        offlineBatchCount = 0;
+    }
+    if (offlineBatchCount == 0) {
+        offlineNext = head;
+        
+        // Records still held in RAM have to reach the files before they can be read back
+        if (offlineNext == _offlineStore.tail() && _offlineStore.pending() > 0) {
+            _offlineStore.flush();
+        }
+    }
+    
+    while (offlineBatchCount < offlineWindow && offlineNext < _offlineStore.tail()) {
+        uint32_t end;
+        if (!publishOfflineBatch(offlineNext, end)) {
+            break;
+        }
+        
+        OfflineBatch& batch = offlineBatches[(offlineBatchHead + offlineBatchCount) % MQTT_OFFLINE_WINDOW];
+        batch.end = end;
+        batch.sentAt = now;
+        offlineBatchCount++;
+        offlineNext = end;
+    }
+}
+
+bool FitInfinityMQTT::publishOfflineBatch(uint32_t start, uint32_t& end) {
+    char topicName[MQTT_INBOUND_TOPIC_SIZE];
+    if (!formatPublishTopic(TOPIC_ATTENDANCE_BULK, topicName, sizeof(topicName))) {
+        return false;
+    }
+    
+    // Fill the batch up to what both the publish buffer and the client packet can carry
+    size_t budget = min(sizeof(publishBuffer) - 1, (size_t)(mqttClient.getBufferSize() - (strlen(topicName) + 7)));
+    
+    DocumentLease lease(documentPool);
+    if (!lease) return false;
+    JsonDocument& doc = *lease;
+    
+    // A removed value keeps its pool memory and the overflow flag, so a batch that ran out
+    // of document space is built again from scratch with fewer records. A record that
+    // overflows the document on its own is passed over, or the drain would stall behind it
+    uint16_t limit = offlineBatchRecords;
+    uint16_t skip = 0;
+    uint16_t skipped;
+    for (;;) {
+        uint16_t count = fillOfflineBatch(doc, start, limit, skip, budget, end, skipped);
+        if (!doc.overflowed()) {
+            break;
+        }
+        if (count <= 1) {
+            skip = skipped + 1;
+        } else {
+            limit = count - 1;
+        }
+    }
+    
+    if (end == start || !publishDocument(TOPIC_ATTENDANCE_BULK, doc)) {
+        return false;
+    }
+    
+    // The batch range covers them, so the ack moves the cursor past them
+    if (skipped > 0) {
+        _offlineStore.countCorrupted(skipped);
+        Serial.println("Offline records too large for a batch, skipped: " + String(skipped));
+    }
+    return true;
+}
+
+uint16_t FitInfinityMQTT::fillOfflineBatch(JsonDocument& doc, uint32_t start, uint16_t limit, uint16_t skip,
+                                           size_t budget, uint32_t& end, uint16_t& skipped) {
+    bool binary = (payloadEncoding == PAYLOAD_MSGPACK);
+    
+    doc.clear();
+    stampDocument(doc);
+    doc["offline"] = true;
+    doc["from"] = start;
+    JsonArray records = doc.createNestedArray("attendanceData");
+    size_t size = (binary ? measureMsgPack(doc) : measureJson(doc)) + OFFLINE_BATCH_TRAILER;
+    
+    FitInfinityOfflineStore::Reader reader(_offlineStore, start);
+    OfflineRecord stored;
+    uint16_t count = 0;
+    end = start;
+    skipped = 0;
+    while (count < limit && !doc.overflowed()) {
+        if (!reader.next(stored)) {
+            // Damaged records at the end are covered by the batch so the cursor can pass them
+            end = min(reader.position(), _offlineStore.tail());
+            break;
+        }
+        
+        // Leading records that overflowed the document alone on an earlier build
+        if (skipped < skip) {
+            skipped++;
+            end = reader.position();
+            continue;
+        }
+        
+        JsonObject record = records.createNestedObject();
+        record["seq"] = stored.seq;
+        record["type"] = FitInfinityOfflineStore::typeName(stored.type);
+        record["id"] = stored.id;
+        if (binary) {
+            record["ts"] = stored.epoch;
+        } else {
+            char timestamp[32];
+            FitInfinityOfflineStore::formatTimestamp(stored.epoch, timestamp, sizeof(timestamp));
+            record["timestamp"] = timestamp;
+        }
+        
+        // Counted even when the document overflowed, so the caller retries with one fewer
+        count++;
+        size_t recordSize = (binary ? measureMsgPack(record) : measureJson(record)) + 1;
+        if (!doc.overflowed() && size + recordSize > budget) {
+            records.remove(records.size() - 1);
+            count--;
+            
+            // Too large even for an empty batch: covered by the range and passed over
+            if (count == 0) {
+                skipped++;
+                end = reader.position();
+            }
+            break;
+        }
+        size += recordSize;
+        end = reader.position();
+    }
+    
+    doc["to"] = end;
+    doc["count"] = count;
+    return count;
+}
+
+void FitInfinityMQTT::acknowledgeOfflineBatches(uint32_t end) {
+    // Acks are cumulative: every record before end is stored by the backend. The batches
+    // left keep the time they were last published, so partial acks cannot stretch their timeout
+    while (offlineBatchCount > 0 && offlineBatches[offlineBatchHead].end <= end) {
+        offlineBatchHead = (offlineBatchHead + 1) % MQTT_OFFLINE_WINDOW;
+        offlineBatchCount--;
+    }
+}
+
+void FitInfinityMQTT::handleOfflineAckMessage(const char* topic, JsonVariant doc) {
+    if (!doc.containsKey("to")) {
+        return;
+    }
+    
+    // Only ranges that were actually published can move the cursor
+    uint32_t end = doc["to"];
+    if (!offlineDrain || end <= _offlineStore.head() || end > offlineNext) {
+        return;
+    }
+    
+    if (_offlineStore.commit(end)) {
+        acknowledgeOfflineBatches(end);
+    }
+}
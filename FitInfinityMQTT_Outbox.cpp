@@ -0,0 +1,347 @@
+#include "FitInfinityMQTT.h"
+#include <esp_system.h>
+
+// Attendance Outbox Functions
+
+static const char* OUTBOX_SPILL_FILE = "/outbox.dat";
+static const char* OUTBOX_SPILL_TEMP = "/outbox.tmp";
+static const uint32_t OUTBOX_SEQ_BLOCK = 256; // sequence numbers reserved per NVS write
+
+void FitInfinityMQTT::setOutboxRate(uint16_t eventsPerSecond, uint16_t window, unsigned long ackTimeoutMs) {
+    outboxRate = eventsPerSecond > 0 ? eventsPerSecond : 1;
+    outboxWindow = constrain(window, 1, MQTT_OUTBOX_CAPACITY);
+    outboxAckTimeout = ackTimeoutMs;
+}
+
+void FitInfinityMQTT::setOutboxAcks(bool enabled) {
+    outboxAcks = enabled;
+}
+
+void FitInfinityMQTT::setAttendanceBatching(uint8_t maxRecords, unsigned long maxDelayMs) {
+    outboxBatchRecords = maxRecords > 0 ? maxRecords : 1;
+    outboxBatchDelay = maxDelayMs;
+}
+
+FitInfinityMQTT* FitInfinityMQTT::shutdownOutbox = nullptr;
+
+uint32_t FitInfinityMQTT::getOutboxPending() {
+    return outboxCount + (outboxSpillCount - outboxSpillRead);
+}
+
+uint32_t FitInfinityMQTT::getOutboxDropped() {
+    return outboxDropped + outboundDropped;
+}
+
+void FitInfinityMQTT::restoreOutbox() {
+    outboxRestored = true;
+    
+    // Resume numbering past anything handed out before the last restart
+    Preferences preferences;
+    preferences.begin("outbox", true);
+    outboxNextSeq = preferences.getUInt("seq", 0);
+    preferences.end();
+    outboxSeqReserved = outboxNextSeq;
+    
+    // Events spilled before a restart are replayed; the server ignores seqs it already has
+    File file = outboxFileSystem().open(OUTBOX_SPILL_FILE);
+    if (file) {
+        outboxSpillCount = file.size() / sizeof(OutboxEvent);
+        outboxSpillRead = 0;
+        file.close();
+        loadSpilledEvents();
+        
+        Serial.println("Recovered " + String(outboxSpillCount) + " spilled attendance events");
+    }
+    
+    // A software restart saves the unacknowledged events still held in RAM
+    if (!shutdownOutbox) {
+        esp_register_shutdown_handler(spillOutboxOnShutdown);
+    }
+    shutdownOutbox = this;
+}
+
+void FitInfinityMQTT::spillOutboxOnShutdown() {
+    if (shutdownOutbox) {
+        shutdownOutbox->spillOutbox();
+    }
+}
+
+void FitInfinityMQTT::spillOutbox() {
+    NetworkLock lock(networkMutex);
+    
+    // Scans the network task has not picked up yet go in behind the ring
+    OutboxEvent* queued;
+    while ((queued = outboundQueue.front()) != nullptr) {
+        enqueueOutbox(queued->type, queued->id, queued->timestamp);
+        outboundQueue.pop();
+    }
+    if (outboxCount == 0) {
+        return;
+    }
+    
+    // The spill file may start with events from before this boot that were never loaded;
+    // the ring is newer than those and older than anything spilled since
+    fs::FS& fs = outboxFileSystem();
+    File previous = fs.open(OUTBOX_SPILL_FILE);
+    uint32_t fileEvents = previous ? previous.size() / sizeof(OutboxEvent) : 0;
+    uint32_t older = fileEvents > outboxSpillCount ? fileEvents - outboxSpillCount : 0;
+    
+    File file = fs.open(OUTBOX_SPILL_TEMP, FILE_WRITE);
+    if (!file) {
+        Serial.println("Outbox: could not save unacknowledged events");
+        return;
+    }
+    
+    OutboxEvent event;
+    bool success = true;
+    for (uint32_t i = 0; success && i < older; i++) {
+        success = previous.read((uint8_t*)&event, sizeof(event)) == sizeof(event) &&
+                  file.write((const uint8_t*)&event, sizeof(event)) == sizeof(event);
+    }
+    for (uint16_t i = 0; success && i < outboxCount; i++) {
+        const OutboxEvent& held = outbox[(outboxHead + i) % MQTT_OUTBOX_CAPACITY];
+        success = file.write((const uint8_t*)&held, sizeof(held)) == sizeof(held);
+    }
+    if (previous) {
+        previous.seek((older + outboxSpillRead) * sizeof(OutboxEvent));
+        while (success && previous.read((uint8_t*)&event, sizeof(event)) == sizeof(event)) {
+            success = file.write((const uint8_t*)&event, sizeof(event)) == sizeof(event);
+        }
+        previous.close();
+    }
+    file.close();
+    
+    if (!success || (fs.exists(OUTBOX_SPILL_FILE) && !fs.remove(OUTBOX_SPILL_FILE)) ||
+        !fs.rename(OUTBOX_SPILL_TEMP, OUTBOX_SPILL_FILE)) {
+        fs.remove(OUTBOX_SPILL_TEMP);
+        Serial.println("Outbox: could not save unacknowledged events");
+    }
+}
+
+fs::FS& FitInfinityMQTT::outboxFileSystem() {
+    // Same medium as the offline store: the SD card when there is one, else internal flash.
+    // Only overflow beyond the RAM ring is written, so flash sees writes during outages only.
+    if (isSDCardEnabled()) {
+        return SD;
+    }
+    return LittleFS;
+}
+
+uint32_t FitInfinityMQTT::nextOutboxSeq() {
+    if (outboxNextSeq >= outboxSeqReserved) {
+        outboxSeqReserved = outboxNextSeq + OUTBOX_SEQ_BLOCK;
+        
+        Preferences preferences;
+        preferences.begin("outbox", false);
+        preferences.putUInt("seq", outboxSeqReserved);
+        preferences.end();
+    }
+    return outboxNextSeq++;
+}
+
+bool FitInfinityMQTT::enqueueOutbox(const char* type, const char* id, const char* timestamp) {
+    OutboxEvent event;
+    memset(&event, 0, sizeof(event));
+    event.seq = nextOutboxSeq();
+    strncpy(event.type, type, sizeof(event.type) - 1);
+    strncpy(event.id, id, sizeof(event.id) - 1);
+    strncpy(event.timestamp, timestamp, sizeof(event.timestamp) - 1);
+    
+    // Start the batching clock when this is the only unsent event
+    if (outboxCount == outboxInFlight && outboxSpillRead == outboxSpillCount) {
+        outboxUnsentSince = millis();
+    }
+    
+    // Keep order: once anything is spilled, newer events go behind it
+    if (outboxCount < MQTT_OUTBOX_CAPACITY && outboxSpillRead == outboxSpillCount) {
+        outbox[(outboxHead + outboxCount) % MQTT_OUTBOX_CAPACITY] = event;
+        outboxCount++;
+        return true;
+    }
+    
+    if (spillOutboxEvent(event)) {
+        return true;
+    }
+    
+    outboxDropped++;
+    return false;
+}
+
+bool FitInfinityMQTT::spillOutboxEvent(const OutboxEvent& event) {
+    File file = outboxFileSystem().open(OUTBOX_SPILL_FILE, FILE_APPEND);
+    if (!file) {
+        return false;
+    }
+    
+    size_t written = file.write((const uint8_t*)&event, sizeof(event));
+    file.close();
+    
+    if (written != sizeof(event)) {
+        return false;
+    }
+    outboxSpillCount++;
+    return true;
+}
+
+void FitInfinityMQTT::loadSpilledEvents() {
+    if (outboxSpillRead >= outboxSpillCount || outboxCount >= MQTT_OUTBOX_CAPACITY) {
+        return;
+    }
+    
+    File file = outboxFileSystem().open(OUTBOX_SPILL_FILE);
+    if (!file) {
+        outboxSpillRead = outboxSpillCount = 0;
+        return;
+    }
+    
+    file.seek(outboxSpillRead * sizeof(OutboxEvent));
+    while (outboxCount < MQTT_OUTBOX_CAPACITY && outboxSpillRead < outboxSpillCount) {
+        OutboxEvent& slot = outbox[(outboxHead + outboxCount) % MQTT_OUTBOX_CAPACITY];
+        if (file.read((uint8_t*)&slot, sizeof(OutboxEvent)) != sizeof(OutboxEvent)) {
+            // Torn tail from a reset mid-write; nothing after it is usable
+            outboxSpillCount = outboxSpillRead;
+            break;
+        }
+        outboxCount++;
+        outboxSpillRead++;
+    }
+    file.close();
+    
+    // Everything spilled is back in RAM, so the file can go
+    if (outboxSpillRead >= outboxSpillCount) {
+        outboxFileSystem().remove(OUTBOX_SPILL_FILE);
+        outboxSpillRead = outboxSpillCount = 0;
+    }
+}
+
+void FitInfinityMQTT::drainOutbox() {
+    if (outboxCount == 0) {
+        return;
+    }
+    
+    unsigned long now = millis();
+    
+    // No ack for the oldest in-flight event in time: resend the whole window
+    if (outboxInFlight > 0 && now - outboxSentAt > outboxAckTimeout) {
+        Serial.println("Outbox ack timeout, resending from seq " + String(outbox[outboxHead].seq));
+        outboxInFlight = 0;
+    }
+    
+    // Micro-batching: hold live scans until the batch fills or the oldest has waited long enough
+    uint16_t unsent = outboxCount - outboxInFlight;
+    if (outboxBatchRecords > 1 && unsent < outboxBatchRecords && now - outboxUnsentSince < outboxBatchDelay) {
+        return;
+    }
+    
+    // Token bucket: events allowed since the last drain, capped at the window
+    unsigned long allowance = (now - outboxLastDrain) * outboxRate / 1000;
+    if (allowance == 0) {
+        return;
+    }
+    outboxLastDrain = now;
+    
+    while (allowance > 0 && outboxInFlight < outboxCount && outboxInFlight < outboxWindow) {
+        size_t limit = min(allowance, (unsigned long)(outboxWindow - outboxInFlight));
+        size_t sent;
+        if (outboxBatchRecords > 1) {
+            sent = drainOutboxBatch(min(limit, (size_t)outboxBatchRecords));
+        } else {
+            sent = publishOutboxEvent(outbox[(outboxHead + outboxInFlight) % MQTT_OUTBOX_CAPACITY]) ? 1 : 0;
+        }
+        if (sent == 0) {
+            break;
+        }
+        
+        if (!outboxAcks) {
+            // Fire-and-forget: a successful publish is the acknowledgement
+            acknowledgeOutbox(outbox[(outboxHead + sent - 1) % MQTT_OUTBOX_CAPACITY].seq);
+        } else {
+            if (outboxInFlight == 0) {
+                outboxSentAt = now;
+            }
+            outboxInFlight += sent;
+        }
+        allowance -= sent;
+    }
+    
+    outboxUnsentSince = now;
+}
+
+size_t FitInfinityMQTT::drainOutboxBatch(size_t limit) {
+    limit = min(limit, (size_t)(outboxCount - outboxInFlight));
+    
+    DocumentLease lease(documentPool);
+    if (!lease) {
+        return 0;
+    }
+    JsonDocument& doc = *lease;
+    JsonArray records = doc.to<JsonArray>();
+    for (size_t i = 0; i < limit; i++) {
+        const OutboxEvent& event = outbox[(outboxHead + outboxInFlight + i) % MQTT_OUTBOX_CAPACITY];
+        JsonObject record = records.createNestedObject();
+        record["seq"] = event.seq;
+        record["type"] = (const char*)event.type;
+        record["id"] = (const char*)event.id;
+        if (payloadEncoding == PAYLOAD_MSGPACK) {
+            record["ts"] = FitInfinityOfflineStore::parseTimestamp(event.timestamp);
+        } else {
+            record["timestamp"] = (const char*)event.timestamp;
+        }
+        
+        // Batch is as large as the pooled document allows; the rest goes next drain
+        if (doc.overflowed()) {
+            records.remove(records.size() - 1);
+            break;
+        }
+    }
+    
+    // Chunks go out in order, so only the leading published records count as sent
+    return publishAttendanceChunks(records, true);
+}
+
+bool FitInfinityMQTT::publishOutboxEvent(const OutboxEvent& event) {
+    DocumentLease lease(documentPool);
+    if (!lease) return false;
+    JsonDocument& doc = *lease;
+    doc["seq"] = event.seq;
+    doc["type"] = (const char*)event.type;
+    doc["id"] = (const char*)event.id;
+    if (payloadEncoding == PAYLOAD_MSGPACK) {
+        doc["ts"] = FitInfinityOfflineStore::parseTimestamp(event.timestamp);
+    } else {
+        doc["deviceId"] = deviceId;
+        doc["timestamp"] = (const char*)event.timestamp;
+        doc["location"] = deviceId; // Device location identifier
+    }
+    
+    TopicId topic = (strcmp(event.type, "rfid") == 0) ? TOPIC_ATTENDANCE_RFID : TOPIC_ATTENDANCE_FINGERPRINT;
+    return publishDocument(topic, doc);
+}
+
+void FitInfinityMQTT::acknowledgeOutbox(uint32_t seq) {
+    // Acks are cumulative: everything up to and including seq is delivered
+    bool released = false;
+    while (outboxCount > 0 && (int32_t)(outbox[outboxHead].seq - seq) <= 0) {
+        outboxHead = (outboxHead + 1) % MQTT_OUTBOX_CAPACITY;
+        outboxCount--;
+        if (outboxInFlight > 0) {
+            outboxInFlight--;
+        }
+        released = true;
+    }
+    
+    if (!released) {
+        return;
+    }
+    
+    // Restart the ack timer for the next oldest event
+    outboxSentAt = millis();
+    loadSpilledEvents();
+}
+
+void FitInfinityMQTT::handleAttendanceAckMessage(const char* topic, JsonVariant doc) {
+    if (!doc.containsKey("seq")) {
+        return;
+    }
+    acknowledgeOutbox(doc["seq"].as<uint32_t>());
+}
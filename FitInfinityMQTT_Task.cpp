@@ -0,0 +1,94 @@
+#include "FitInfinityMQTT.h"
+
+// Threaded Network Mode
+
+bool FitInfinityMQTT::startNetworkTask(BaseType_t core, uint32_t stackSize, UBaseType_t priority) {
+    if (networkTask) {
+        return true;
+    }
+    
+    networkMutex = xSemaphoreCreateRecursiveMutex();
+    if (!networkMutex) {
+        Serial.println("Failed to create network mutex");
+        return false;
+    }
+    
+    if (xTaskCreatePinnedToCore(networkTaskEntry, "fitinfinity-net", stackSize, this,
+                                priority, &networkTask, core) != pdPASS) {
+        Serial.println("Failed to start network task");
+        networkTask = nullptr;
+        return false;
+    }
+    
+    Serial.println("Network task started on core " + String(core));
+    return true;
+}
+
+bool FitInfinityMQTT::isNetworkTaskRunning() {
+    return networkTask != nullptr;
+}
+
+void FitInfinityMQTT::networkTaskEntry(void* arg) {
+    FitInfinityMQTT* self = static_cast<FitInfinityMQTT*>(arg);
+    
+    for (;;) {
+        {
+            NetworkLock lock(self->networkMutex);
+            
+            // Move scans from the loop task into the outbox, oldest first
+            OutboxEvent* event;
+            while ((event = self->outboundQueue.front()) != nullptr) {
+                self->enqueueOutbox(event->type, event->id, event->timestamp);
+                self->outboundQueue.pop();
+            }
+            
+            // DNS, TCP connect and CONNACK run with the lock released (see NetworkUnlock);
+            // skip a turn while connectMQTT() is in one of those on the loop task
+            if (!self->connectStepActive) {
+                self->serviceNetwork();
+            }
+        }
+        
+        // Let the idle task and WiFi stack run between iterations
+        vTaskDelay(pdMS_TO_TICKS(2));
+    }
+}
+
+bool FitInfinityMQTT::queueOutboundEvent(const char* type, const char* id, const char* timestamp) {
+    OutboxEvent* event = outboundQueue.reserve();
+    if (!event) {
+        outboundDropped++;
+        return false;
+    }
+    
+    memset(event, 0, sizeof(OutboxEvent));
+    strncpy(event->type, type, sizeof(event->type) - 1);
+    strncpy(event->id, id, sizeof(event->id) - 1);
+    strncpy(event->timestamp, timestamp, sizeof(event->timestamp) - 1);
+    outboundQueue.commit();
+    return true;
+}
+
+void FitInfinityMQTT::queueInboundMessage(const MqttRoute* route, const char* topic, const byte* payload, unsigned int length) {
+    InboundMessage* message = inboundQueue.reserve();
+    if (!message || length >= sizeof(message->payload) || strlen(topic) >= sizeof(message->topic)) {
+        dispatchStats.queueDrops++;
+        return;
+    }
+    
+    message->route = route;
+    message->length = length;
+    strcpy(message->topic, topic);
+    memcpy(message->payload, payload, length);
+    message->payload[length] = '\0';
+    inboundQueue.commit();
+}
+
+void FitInfinityMQTT::processInboundQueue() {
+    // Handlers run here, on the loop task, with the payload parsed in place
+    InboundMessage* message;
+    while ((message = inboundQueue.front()) != nullptr) {
+        dispatchMessage(message->route, message->topic, message->payload, message->length);
+        inboundQueue.pop();
+    }
+}
@@ -45,7 +45,7 @@ bool FitInfinityMQTT::connectWifi(const String& ssid, const String& password) {
         Serial.println("Signal strength: " + String(WiFi.RSSI()) + " dBm");
         
         // Publish WiFi status via MQTT if connected
-        if (mqttClient.connected()) {
+        if (isMQTTConnected()) {
             publishWifiStatus(true, ssid, WiFi.localIP().toString());
         }
         
@@ -54,7 +54,7 @@ bool FitInfinityMQTT::connectWifi(const String& ssid, const String& password) {
         Serial.println("WiFi connection failed!");
         
         // Publish WiFi status via MQTT if connected
-        if (mqttClient.connected()) {
+        if (isMQTTConnected()) {
             publishWifiStatus(false, ssid, "", "Connection timeout");
         }
         
@@ -313,19 +313,16 @@ void FitInfinityMQTT::scanWifiNetworks() {
 }
 
 void FitInfinityMQTT::publishWifiScanResults(JsonArray networks) {
-    if (!mqttClient.connected()) return;
+    if (!isMQTTConnected()) return;
     
-    DynamicJsonDocument doc(2048);
-    doc["deviceId"] = deviceId;
+    DocumentLease lease(documentPool);
+    if (!lease) return;
+    JsonDocument& doc = *lease;
+    stampDocument(doc);
     doc["networks"] = networks;
-    doc["timestamp"] = getTimestamp();
     doc["action"] = "scan";
     
-    String payload;
-    serializeJson(doc, payload);
-    
-    String topic = getTopicPrefix() + "/config/wifi/request";
-    mqttClient.publish(topic.c_str(), payload.c_str());
+    publishDocument(TOPIC_WIFI_REQUEST, doc);
     
     Serial.println("Published WiFi scan results");
 }
@@ -346,14 +343,15 @@ void FitInfinityMQTT::handleWifiConfig(String ssid, String password) {
 }
 
 void FitInfinityMQTT::publishWifiStatus(bool connected, String ssid, String ipAddress, String error) {
-    if (!mqttClient.connected()) return;
+    if (!isMQTTConnected()) return;
     
-    DynamicJsonDocument doc(512);
-    doc["deviceId"] = deviceId;
+    DocumentLease lease(documentPool);
+    if (!lease) return;
+    JsonDocument& doc = *lease;
+    stampDocument(doc);
     doc["connected"] = connected;
     doc["ssid"] = ssid;
     doc["ipAddress"] = ipAddress;
-    doc["timestamp"] = getTimestamp();
     doc["action"] = "status";
     
     if (!error.isEmpty()) {
@@ -365,20 +363,16 @@ void FitInfinityMQTT::publishWifiStatus(bool connected, String ssid, String ipAd
         doc["macAddress"] = WiFi.macAddress();
     }
     
-    String payload;
-    serializeJson(doc, payload);
-    
-    String topic = getTopicPrefix() + "/config/wifi/status";
-    mqttClient.publish(topic.c_str(), payload.c_str());
+    publishDocument(TOPIC_WIFI_STATUS, doc);
     
     Serial.println("Published WiFi status: " + String(connected ? "connected" : "disconnected"));
 }
 
 void FitInfinityMQTT::subscribeWifiConfig() {
-    if (!mqttClient.connected()) return;
+    if (!isMQTTConnected()) return;
     
-    String topic = getTopicPrefix() + "/config/wifi/response";
-    mqttClient.subscribe(topic.c_str());
+    NetworkLock lock(networkMutex);
+    mqttClient.subscribe(topicFor(TOPIC_WIFI_RESPONSE));
     
     Serial.println("Subscribed to WiFi configuration updates");
 }
\ No newline at end of file
@@ -0,0 +1,972 @@
+#include "FitInfinityOfflineStore.h"
+#include <time.h>
+#include <esp_system.h>
+
+static const uint32_t SEGMENT_MAGIC = 0x534f4946; // "FIOS"
+static const uint32_t PACKED_MAGIC = 0x504f4946;  // "FIOP"
+static const uint8_t PACKED_DAMAGED = 0xff;       // type of a slot whose record failed its CRC
+static const uint32_t CURSOR_MAGIC = 0x43494946;  // "FIIC", single-file cursor of older firmware
+static const uint32_t CURSOR_SLOT_MAGIC = 0x32494946; // "FII2"
+static const unsigned long DRAIN_RATE_WINDOW = 60000;
+
+// On-disk layout, little-endian as written by the ESP32
+struct __attribute__((packed)) SegmentHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t recordSize;
+    uint32_t segment;
+    uint32_t reserved;
+};
+
+struct __attribute__((packed)) StoredRecord {
+    uint32_t seq;
+    uint32_t epoch;
+    uint8_t type;
+    uint8_t reserved[3];
+    char id[24];
+    uint32_t crc;               // CRC-32 of every byte before it
+};
+
+// Packed segment: header, then per record a type byte, the zigzag varint difference
+// from the previous timestamp, and the ID with a length byte. Sequence numbers are implicit.
+struct __attribute__((packed)) PackedHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t count;
+    uint32_t segment;
+    uint32_t length;            // body bytes
+    uint32_t crc;               // CRC-32 of the body
+};
+
+struct StoredCursor {
+    uint32_t magic;
+    uint32_t read;
+};
+
+// Cursor and queue index, written alternately to two slot files so that a power cut
+// mid-write leaves the previous slot intact; the valid slot with the newer generation wins
+struct __attribute__((packed)) CursorSlot {
+    uint32_t magic;
+    uint32_t generation;
+    uint32_t read;
+    uint32_t oldestEpoch;
+    uint32_t delivered;
+    uint32_t crc;               // CRC-32 of every byte before it
+};
+
+// Continues a CRC-32 across calls; start from 0
+static uint32_t crc32Update(uint32_t crc, const uint8_t* data, size_t length) {
+    crc = ~crc;
+    while (length--) {
+        crc ^= *data++;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+static uint32_t crc32(const uint8_t* data, size_t length) {
+    return crc32Update(0, data, length);
+}
+
+static size_t writeVarint(uint8_t* out, uint32_t value) {
+    size_t length = 0;
+    while (value >= 0x80) {
+        out[length++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[length++] = (uint8_t)value;
+    return length;
+}
+
+static uint32_t recordOffset(uint32_t index) {
+    return sizeof(SegmentHeader) + (index % OFFLINE_SEGMENT_RECORDS) * sizeof(StoredRecord);
+}
+
+FitInfinityOfflineStore::FitInfinityOfflineStore(const char* directory) {
+    _fs = nullptr;
+    _directory = directory;
+    _read = _write = 0;
+    _corrupted = 0;
+    _bytes = 0;
+    _packNext = 0;
+    _packing = true;
+    _oldestEpoch = _newestEpoch = 0;
+    _delivered = 0;
+    _cursorGeneration = 0;
+    _drainCount = 0;
+    _drainRate = 0;
+    _drainSince = 0;
+    _memory = nullptr;
+    _memoryCapacity = 0;
+    _memoryHead = 0;
+    _memoryCount = 0;
+    _spillRecords = OFFLINE_SPILL_RECORDS;
+    _spillDelay = OFFLINE_SPILL_DELAY;
+    _memorySince = 0;
+}
+
+FitInfinityOfflineStore* FitInfinityOfflineStore::_shutdownStores[OFFLINE_SHUTDOWN_STORES] = {nullptr};
+bool FitInfinityOfflineStore::_shutdownRegistered = false;
+
+FitInfinityOfflineStore::~FitInfinityOfflineStore() {
+    close();
+    for (uint8_t i = 0; i < OFFLINE_SHUTDOWN_STORES; i++) {
+        if (_shutdownStores[i] == this) {
+            _shutdownStores[i] = nullptr;
+        }
+    }
+    free(_memory);
+}
+
+bool FitInfinityOfflineStore::begin(fs::FS& fs) {
+    // Records still buffered in RAM belong to the previous filesystem
+    if (_fs) {
+        close();
+    }
+    _memoryHead = _memoryCount = 0;
+    
+    // A software restart commits whatever is still buffered, in every open store
+    if (!_shutdownRegistered) {
+        _shutdownRegistered = esp_register_shutdown_handler(flushOnShutdown) == ESP_OK;
+    }
+    registerForShutdown();
+    
+    _fs = &fs;
+    if (!_fs->exists(_directory) && !_fs->mkdir(_directory)) {
+        _fs = nullptr;
+        return false;
+    }
+    
+    // Segment files are named by number, plain or packed; find the oldest and newest left
+    bool found = false;
+    uint32_t first = 0;
+    uint32_t last = 0;
+    _bytes = 0;
+    File dir = _fs->open(_directory);
+    for (File entry = dir.openNextFile(); entry; entry = dir.openNextFile()) {
+        const char* name = strrchr(entry.name(), '/');
+        name = name ? name + 1 : entry.name();
+        char* end;
+        uint32_t segment = strtoul(name, &end, 10);
+        if (end != name && (strcmp(end, ".seg") == 0 || strcmp(end, ".sgz") == 0)) {
+            if (!found || segment < first) first = segment;
+            if (!found || segment > last) last = segment;
+            found = true;
+            _bytes += entry.size();
+        } else if (end != name && strcmp(end, ".tmp") == 0) {
+            // Packing was cut short; the plain segment is still there
+            String path = entry.path();
+            entry.close();
+            _fs->remove(path);
+            continue;
+        }
+        entry.close();
+    }
+    dir.close();
+    
+    uint32_t cursor = 0;
+    bool indexed = false;
+    bool saved = loadCursor(cursor, indexed);
+    
+    if (!found) {
+        // Everything was delivered: keep numbering after it so sequence numbers never repeat
+        _read = _write = saved ? cursor : 0;
+        _oldestEpoch = _newestEpoch = 0;
+        saveCursor();
+        return true;
+    }
+    
+    // Repairs at most the one record a power cut can tear, whatever the backlog size
+    recoverWritePosition(last);
+    
+    // Ignore a cursor that points outside the records actually present
+    if (!saved || cursor < first * OFFLINE_SEGMENT_RECORDS || cursor > _write) {
+        cursor = first * OFFLINE_SEGMENT_RECORDS;
+        indexed = false;
+    }
+    _read = cursor;
+    _packNext = _read / OFFLINE_SEGMENT_RECORDS + 1;
+    recoverIndex(indexed);
+    return true;
+}
+
+bool FitInfinityOfflineStore::isReady() {
+    return _fs != nullptr;
+}
+
+bool FitInfinityOfflineStore::append(uint8_t type, const char* id, uint32_t epoch) {
+    if (!_fs) return false;
+    
+    OfflineRecord record;
+    memset(&record, 0, sizeof(record));
+    record.epoch = epoch;
+    record.type = type;
+    strncpy(record.id, id, sizeof(record.id) - 1);
+    
+    if (_memory) {
+        // Make room by spilling; if the files are unavailable the new record is refused
+        if (_memoryCount == _memoryCapacity && !flush()) {
+            return false;
+        }
+        if (_memoryCount == 0) {
+            _memorySince = millis();
+        }
+        _memory[(_memoryHead + _memoryCount) % _memoryCapacity] = record;
+        _memoryCount++;
+        
+        if (_memoryCount >= _spillRecords) {
+            flush();
+        }
+        return true;
+    }
+    
+    // Write-through: the file stays open, but every record is committed on its own
+    if (!openForAppend() || !writeRecord(record)) {
+        return false;
+    }
+    _appendFile.flush();
+    return true;
+}
+
+bool FitInfinityOfflineStore::setMemoryTier(size_t capacity, uint16_t spillRecords, unsigned long spillDelayMs) {
+    if (!flush()) {
+        return false;
+    }
+    
+    free(_memory);
+    _memory = nullptr;
+    _memoryCapacity = 0;
+    _memoryHead = 0;
+    if (capacity == 0) {
+        return true;
+    }
+    
+    size_t bytes = capacity * sizeof(OfflineRecord);
+    _memory = (OfflineRecord*)(psramFound() ? ps_malloc(bytes) : malloc(bytes));
+    if (!_memory) {
+        return false;
+    }
+    _memoryCapacity = capacity;
+    _spillRecords = constrain(spillRecords, 1, capacity);
+    _spillDelay = spillDelayMs;
+    return true;
+}
+
+void FitInfinityOfflineStore::setSpillPolicy(uint16_t spillRecords, unsigned long spillDelayMs) {
+    _spillRecords = constrain(spillRecords, 1, max(_memoryCapacity, (size_t)1));
+    _spillDelay = spillDelayMs;
+}
+
+bool FitInfinityOfflineStore::flush() {
+    if (_memoryCount == 0) return true;
+    if (!_fs) return false;
+    
+    // Group commit: the whole batch goes out in one write sequence and one metadata update
+    bool success = true;
+    while (_memoryCount > 0) {
+        if (!openForAppend() || !writeRecord(_memory[_memoryHead])) {
+            success = false;
+            break;
+        }
+        _memoryHead = (_memoryHead + 1) % _memoryCapacity;
+        _memoryCount--;
+    }
+    if (_appendFile) {
+        _appendFile.flush();
+    }
+    return success;
+}
+
+void FitInfinityOfflineStore::maintain() {
+    if (_memoryCount > 0 && millis() - _memorySince >= _spillDelay) {
+        flush();
+    }
+    
+    // Lets the rate decay while nothing is being committed
+    updateDrainRate();
+    
+    // At most one segment per call keeps the loop responsive during a long outage
+    if (_packing) {
+        pack(1);
+    }
+}
+
+void FitInfinityOfflineStore::setPacking(bool enabled) {
+    _packing = enabled;
+}
+
+uint32_t FitInfinityOfflineStore::pack(uint32_t maxSegments) {
+    if (!_fs) return 0;
+    
+    // Only sealed segments behind the one at the cursor; that one is about to be drained
+    uint32_t packed = 0;
+    _packNext = max(_packNext, _read / OFFLINE_SEGMENT_RECORDS + 1);
+    while (packed < maxSegments && _packNext < _write / OFFLINE_SEGMENT_RECORDS) {
+        if (packSegment(_packNext)) {
+            packed++;
+        }
+        _packNext++;
+    }
+    return packed;
+}
+
+void FitInfinityOfflineStore::close() {
+    flush();
+    _appendFile.close();
+}
+
+void FitInfinityOfflineStore::registerForShutdown() {
+    int8_t freeSlot = -1;
+    for (uint8_t i = 0; i < OFFLINE_SHUTDOWN_STORES; i++) {
+        if (_shutdownStores[i] == this) return;
+        if (!_shutdownStores[i] && freeSlot < 0) {
+            freeSlot = i;
+        }
+    }
+    if (freeSlot < 0) {
+        Serial.println("Offline store: too many stores, buffered records are not flushed on restart");
+        return;
+    }
+    _shutdownStores[freeSlot] = this;
+}
+
+void FitInfinityOfflineStore::flushOnShutdown() {
+    for (uint8_t i = 0; i < OFFLINE_SHUTDOWN_STORES; i++) {
+        if (_shutdownStores[i]) {
+            _shutdownStores[i]->close();
+        }
+    }
+}
+
+bool FitInfinityOfflineStore::read(uint32_t index, OfflineRecord& record) {
+    if (!_fs || index < _read || index >= _write) {
+        return false;
+    }
+    
+    File file;
+    if (!openSegment(index / OFFLINE_SEGMENT_RECORDS, file)) {
+        // Packed segments have no fixed offsets; decode up to the record
+        PackedReader packed;
+        if (!packed.open(*this, index / OFFLINE_SEGMENT_RECORDS)) {
+            return false;
+        }
+        bool damaged;
+        while (packed.next(record, damaged)) {
+            if (record.seq == index) {
+                return !damaged;
+            }
+        }
+        return false;
+    }
+    
+    uint8_t data[sizeof(StoredRecord)];
+    bool success = file.seek(recordOffset(index)) &&
+                   file.read(data, sizeof(data)) == sizeof(data) &&
+                   decodeRecord(data, record) && record.seq == index;
+    file.close();
+    return success;
+}
+
+bool FitInfinityOfflineStore::commit(uint32_t index) {
+    if (!_fs || index < _read || index > _write) return false;
+    
+    // Whole segments behind the new cursor are done with
+    for (uint32_t segment = _read / OFFLINE_SEGMENT_RECORDS; segment < index / OFFLINE_SEGMENT_RECORDS; segment++) {
+        removeSegment(segment);
+    }
+    
+    // One record read keeps the oldest timestamp exact without rescanning
+    _drainCount += index - _read;
+    _delivered += index - _read;
+    _read = index;
+    OfflineRecord oldest;
+    if (_read < _write && read(_read, oldest)) {
+        _oldestEpoch = oldest.epoch;
+    }
+    updateDrainRate();
+    return saveCursor();
+}
+
+uint32_t FitInfinityOfflineStore::head() {
+    return _read;
+}
+
+uint32_t FitInfinityOfflineStore::tail() {
+    return _write;
+}
+
+uint32_t FitInfinityOfflineStore::pending() {
+    return _write - _read + _memoryCount;
+}
+
+uint32_t FitInfinityOfflineStore::segmentCount() {
+    if (_write == _read) return 0;
+    return (_write - 1) / OFFLINE_SEGMENT_RECORDS - _read / OFFLINE_SEGMENT_RECORDS + 1;
+}
+
+uint32_t FitInfinityOfflineStore::corrupted() {
+    return _corrupted;
+}
+
+void FitInfinityOfflineStore::countCorrupted(uint32_t records) {
+    _corrupted += records;
+}
+
+OfflineStats FitInfinityOfflineStore::stats() {
+    // Read-only: the drain rate is rolled over by commit() and maintain()
+    OfflineStats stats;
+    stats.pending = pending();
+    stats.buffered = _memoryCount;
+    stats.segments = segmentCount();
+    stats.delivered = _delivered;
+    stats.drainRate = _drainRate;
+    stats.corrupted = _corrupted;
+    
+    stats.bytes = _bytes;
+    
+    // Stored records are older than anything still buffered in RAM
+    stats.oldestEpoch = _write > _read ? _oldestEpoch :
+                        _memoryCount > 0 ? _memory[_memoryHead].epoch : 0;
+    stats.newestEpoch = _memoryCount > 0 ? _memory[(_memoryHead + _memoryCount - 1) % _memoryCapacity].epoch :
+                        _write > _read ? _newestEpoch : 0;
+    return stats;
+}
+
+void FitInfinityOfflineStore::updateDrainRate() {
+    unsigned long now = millis();
+    unsigned long elapsed = now - _drainSince;
+    if (elapsed < DRAIN_RATE_WINDOW) {
+        return;
+    }
+    
+    // A long idle gap spreads the last window's commits over it, so the rate decays to zero
+    _drainRate = (uint32_t)((uint64_t)_drainCount * 60000 / elapsed);
+    _drainCount = 0;
+    _drainSince = now;
+}
+
+uint8_t FitInfinityOfflineStore::parseType(const char* type) {
+    if (strcmp(type, "fingerprint") == 0) return OFFLINE_FINGERPRINT;
+    if (strcmp(type, "rfid") == 0) return OFFLINE_RFID;
+    return OFFLINE_UNKNOWN;
+}
+
+const char* FitInfinityOfflineStore::typeName(uint8_t type) {
+    switch (type) {
+        case OFFLINE_FINGERPRINT: return "fingerprint";
+        case OFFLINE_RFID: return "rfid";
+        default: return "unknown";
+    }
+}
+
+uint32_t FitInfinityOfflineStore::parseTimestamp(const char* timestamp) {
+    // "YYYY-MM-DDTHH:MM:SS.000Z" as produced by getTimestamp(); 0 when unset
+    int year, month, day, hour, minute, second;
+    if (!timestamp || sscanf(timestamp, "%d-%d-%dT%d:%d:%d", &year, &month, &day, &hour, &minute, &second) != 6) {
+        return 0;
+    }
+    
+    // Days since 1970-01-01 in the proleptic Gregorian calendar
+    year -= month <= 2;
+    int era = year / 400;
+    int yearOfEra = year - era * 400;
+    int dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    long days = (long)era * 146097 + dayOfEra - 719468;
+    
+    return (uint32_t)(days * 86400L + hour * 3600L + minute * 60L + second);
+}
+
+void FitInfinityOfflineStore::formatTimestamp(uint32_t epoch, char* buffer, size_t size) {
+    buffer[0] = '\0';
+    if (epoch == 0) return;
+    
+    time_t seconds = epoch;
+    struct tm timeinfo;
+    gmtime_r(&seconds, &timeinfo);
+    strftime(buffer, size, "%Y-%m-%dT%H:%M:%S.000Z", &timeinfo);
+}
+
+String FitInfinityOfflineStore::segmentPath(uint32_t segment, const char* extension) {
+    char path[48];
+    snprintf(path, sizeof(path), "%s/%08lu.%s", _directory, (unsigned long)segment, extension);
+    return String(path);
+}
+
+bool FitInfinityOfflineStore::packSegment(uint32_t segment) {
+    File source;
+    if (!openSegment(segment, source)) {
+        return false;               // already packed, or unreadable
+    }
+    String tempPath = segmentPath(segment, "tmp");
+    File target = _fs->open(tempPath, FILE_WRITE);
+    if (!target) {
+        source.close();
+        return false;
+    }
+    
+    // Header goes in last, once the body length and CRC are known
+    PackedHeader header = {PACKED_MAGIC, OFFLINE_PACKED_VERSION, 0, segment, 0, 0};
+    bool success = target.write((const uint8_t*)&header, sizeof(header)) == sizeof(header);
+    
+    uint32_t epoch = 0;
+    uint8_t data[sizeof(StoredRecord)];
+    while (success && header.count < OFFLINE_SEGMENT_RECORDS &&
+           source.read(data, sizeof(data)) == sizeof(data)) {
+        OfflineRecord record;
+        uint8_t out[8 + sizeof(record.id)];
+        size_t length = 0;
+        if (decodeRecord(data, record)) {
+            int32_t delta = (int32_t)(record.epoch - epoch);
+            size_t idLength = strlen(record.id);
+            out[length++] = record.type;
+            length += writeVarint(out + length, ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+            out[length++] = (uint8_t)idLength;
+            memcpy(out + length, record.id, idLength);
+            length += idLength;
+            epoch = record.epoch;
+        } else {
+            // Keep the slot so later records keep their index
+            out[length++] = PACKED_DAMAGED;
+        }
+        success = target.write(out, length) == length;
+        header.crc = crc32Update(header.crc, out, length);
+        header.length += length;
+        header.count++;
+    }
+    source.close();
+    
+    success = success && target.seek(0) &&
+              target.write((const uint8_t*)&header, sizeof(header)) == sizeof(header);
+    target.close();
+    
+    // Rename before delete: a cut in between leaves both, and the plain one is read first
+    String packedPath = segmentPath(segment, "sgz");
+    removeFile(packedPath);
+    if (!success || !_fs->rename(tempPath, packedPath)) {
+        _fs->remove(tempPath);
+        return false;
+    }
+    _bytes += sizeof(header) + header.length;
+    removeFile(segmentPath(segment));
+    return true;
+}
+
+void FitInfinityOfflineStore::removeSegment(uint32_t segment) {
+    removeFile(segmentPath(segment));
+    removeFile(segmentPath(segment, "sgz"));
+}
+
+void FitInfinityOfflineStore::removeFile(const String& path) {
+    if (!_fs->exists(path)) {
+        return;
+    }
+    File file = _fs->open(path);
+    if (!file) {
+        return;
+    }
+    _bytes -= min((uint32_t)file.size(), _bytes);
+    file.close();
+    _fs->remove(path);
+}
+
+bool FitInfinityOfflineStore::openForAppend() {
+    // Reopened only when a segment fills up, not once per record or batch
+    if (_appendFile) {
+        return true;
+    }
+    
+    String path = segmentPath(_write / OFFLINE_SEGMENT_RECORDS);
+    _appendFile = _fs->open(path, FILE_APPEND);
+    if (!_appendFile) {
+        return false;
+    }
+    
+    // A header cut short holds no records; start the segment again
+    if (_appendFile.size() > 0 && _appendFile.size() < sizeof(SegmentHeader)) {
+        _appendFile.close();
+        removeFile(path);
+        _appendFile = _fs->open(path, FILE_APPEND);
+        if (!_appendFile) {
+            return false;
+        }
+    }
+    
+    // After a failed write the file may end in a partial record; skip past it
+    if (_appendFile.size() > sizeof(SegmentHeader)) {
+        _write = _write / OFFLINE_SEGMENT_RECORDS * OFFLINE_SEGMENT_RECORDS + sealTornRecord(_appendFile);
+        if (_write % OFFLINE_SEGMENT_RECORDS == 0) {
+            _appendFile.close();
+            return openForAppend();
+        }
+    }
+    
+    // First record of a segment goes in behind a fresh header
+    if (_appendFile.size() == 0) {
+        SegmentHeader header = {SEGMENT_MAGIC, OFFLINE_FORMAT_VERSION, sizeof(StoredRecord),
+                                _write / OFFLINE_SEGMENT_RECORDS, 0};
+        if (_appendFile.write((const uint8_t*)&header, sizeof(header)) != sizeof(header)) {
+            _appendFile.close();
+            return false;
+        }
+        _bytes += sizeof(header);
+    }
+    return true;
+}
+
+bool FitInfinityOfflineStore::writeRecord(const OfflineRecord& record) {
+    StoredRecord stored;
+    memset(&stored, 0, sizeof(stored));
+    stored.seq = _write;
+    stored.epoch = record.epoch;
+    stored.type = record.type;
+    memcpy(stored.id, record.id, sizeof(stored.id));
+    stored.id[sizeof(stored.id) - 1] = '\0';
+    stored.crc = crc32((const uint8_t*)&stored, offsetof(StoredRecord, crc));
+    
+    if (_appendFile.write((const uint8_t*)&stored, sizeof(stored)) != sizeof(stored)) {
+        // Whatever part did land is a torn record; the next open seals it
+        _appendFile.close();
+        return false;
+    }
+    _bytes += sizeof(stored);
+    if (_write == _read) {
+        _oldestEpoch = record.epoch;
+    }
+    _newestEpoch = record.epoch;
+    _write++;
+    
+    // A full segment is closed so the cursor can delete it once it is delivered
+    if (_write % OFFLINE_SEGMENT_RECORDS == 0) {
+        _appendFile.close();
+    }
+    return true;
+}
+
+bool FitInfinityOfflineStore::openSegment(uint32_t segment, File& file) {
+    file = _fs->open(segmentPath(segment));
+    if (!file) {
+        return false;
+    }
+    
+    // Refuse segments written by another format version
+    SegmentHeader header;
+    if (file.read((uint8_t*)&header, sizeof(header)) != sizeof(header) ||
+        header.magic != SEGMENT_MAGIC || header.version != OFFLINE_FORMAT_VERSION ||
+        header.recordSize != sizeof(StoredRecord)) {
+        file.close();
+        return false;
+    }
+    return true;
+}
+
+bool FitInfinityOfflineStore::decodeRecord(const uint8_t* data, OfflineRecord& record) {
+    StoredRecord stored;
+    memcpy(&stored, data, sizeof(stored));
+    if (stored.crc != crc32(data, offsetof(StoredRecord, crc))) {
+        _corrupted++;
+        return false;
+    }
+    
+    record.seq = stored.seq;
+    record.epoch = stored.epoch;
+    record.type = stored.type;
+    memcpy(record.id, stored.id, sizeof(record.id));
+    record.id[sizeof(record.id) - 1] = '\0';
+    return true;
+}
+
+void FitInfinityOfflineStore::recoverWritePosition(uint32_t segment) {
+    _write = segment * OFFLINE_SEGMENT_RECORDS;
+    
+    File file;
+    if (!openSegment(segment, file)) {
+        // Unreadable newest segment: leave it for the reader to skip and start a new one
+        _write += OFFLINE_SEGMENT_RECORDS;
+        return;
+    }
+    file.close();
+    
+    // Record count follows from the file size, so recovery reads nothing but the header
+    file = _fs->open(segmentPath(segment), FILE_APPEND);
+    if (!file) {
+        _write += OFFLINE_SEGMENT_RECORDS;
+        return;
+    }
+    _write += sealTornRecord(file);
+    file.close();
+}
+
+uint32_t FitInfinityOfflineStore::sealTornRecord(File& file) {
+    size_t body = file.size() - sizeof(SegmentHeader);
+    uint32_t count = body / sizeof(StoredRecord);
+    size_t torn = body % sizeof(StoredRecord);
+    
+    // A cut mid-append leaves a partial record; pad it out so it fails its CRC and is skipped
+    if (torn > 0) {
+        uint8_t zeros[sizeof(StoredRecord)] = {0};
+        _bytes += file.write(zeros, sizeof(StoredRecord) - torn);
+        file.flush();
+        count++;
+        Serial.println("Offline store: sealed a torn record in " + String(file.name()));
+    }
+    return count;
+}
+
+bool FitInfinityOfflineStore::loadCursor(uint32_t& read, bool& indexed) {
+    bool found = false;
+    CursorSlot best;
+    for (uint8_t slot = 0; slot < 2; slot++) {
+        CursorSlot candidate;
+        File file = _fs->open(cursorPath(slot));
+        bool valid = file && file.read((uint8_t*)&candidate, sizeof(candidate)) == sizeof(candidate) &&
+                     candidate.magic == CURSOR_SLOT_MAGIC &&
+                     candidate.crc == crc32((const uint8_t*)&candidate, offsetof(CursorSlot, crc));
+        file.close();
+        if (valid && (!found || (int32_t)(candidate.generation - best.generation) > 0)) {
+            best = candidate;
+            found = true;
+        }
+    }
+    
+    if (found) {
+        _cursorGeneration = best.generation;
+        _oldestEpoch = best.oldestEpoch;
+        _delivered = best.delivered;
+        read = best.read;
+        indexed = true;
+        return true;
+    }
+    
+    // Older firmware kept only the read position, in a single file
+    _delivered = 0;
+    indexed = false;
+    File file = _fs->open(String(_directory) + "/cursor");
+    if (!file) {
+        return false;
+    }
+    StoredCursor cursor;
+    bool valid = file.read((uint8_t*)&cursor, sizeof(cursor)) == sizeof(cursor) &&
+                 cursor.magic == CURSOR_MAGIC;
+    file.close();
+    if (valid) {
+        read = cursor.read;
+    }
+    return valid;
+}
+
+void FitInfinityOfflineStore::recoverIndex(bool indexed) {
+    _newestEpoch = 0;
+    if (_write == _read) {
+        _oldestEpoch = 0;
+        return;
+    }
+    
+    OfflineRecord record;
+    if (!indexed && read(_read, record)) {
+        _oldestEpoch = record.epoch;
+    }
+    
+    // Walk back over damaged records only, so this stays proportional to the damage
+    for (uint32_t index = _write; index > _read; index--) {
+        if (read(index - 1, record)) {
+            _newestEpoch = record.epoch;
+            break;
+        }
+    }
+}
+
+bool FitInfinityOfflineStore::saveCursor() {
+    CursorSlot slot;
+    slot.magic = CURSOR_SLOT_MAGIC;
+    slot.generation = _cursorGeneration + 1;
+    slot.read = _read;
+    slot.oldestEpoch = _oldestEpoch;
+    slot.delivered = _delivered;
+    slot.crc = crc32((const uint8_t*)&slot, offsetof(CursorSlot, crc));
+    
+    // Overwrite the older slot; the newer one stays valid until this write is complete
+    File file = _fs->open(cursorPath(slot.generation % 2), FILE_WRITE);
+    if (!file) {
+        return false;
+    }
+    bool success = file.write((const uint8_t*)&slot, sizeof(slot)) == sizeof(slot);
+    file.close();
+    if (success) {
+        _cursorGeneration = slot.generation;
+    }
+    return success;
+}
+
+String FitInfinityOfflineStore::cursorPath(uint8_t slot) {
+    char path[48];
+    snprintf(path, sizeof(path), "%s/cursor.%u", _directory, slot);
+    return String(path);
+}
+
+// Reader
+
+FitInfinityOfflineStore::Reader::Reader(FitInfinityOfflineStore& store)
+    : _store(store), _position(store._read), _segment(0) {}
+
+FitInfinityOfflineStore::Reader::Reader(FitInfinityOfflineStore& store, uint32_t start)
+    : _store(store), _position(max(start, store._read)), _segment(0) {}
+
+bool FitInfinityOfflineStore::Reader::next(OfflineRecord& record) {
+    if (!_store._fs) return false;
+    
+    while (_position < _store._write) {
+        uint32_t segment = _position / OFFLINE_SEGMENT_RECORDS;
+        if ((!_file && !_packed.isOpen()) || _segment != segment) {
+            _file.close();
+            _packed.close();
+            _segment = segment;
+            if (_store.openSegment(segment, _file)) {
+                if (!_file.seek(recordOffset(_position))) {
+                    return false;
+                }
+            } else if (!_packed.open(_store, segment)) {
+                // Missing or foreign segment: nothing in it can be delivered
+                _position = (segment + 1) * OFFLINE_SEGMENT_RECORDS;
+                continue;
+            }
+        }
+        
+        if (_packed.isOpen()) {
+            bool damaged;
+            if (!_packed.next(record, damaged)) {
+                _packed.close();
+                _position = (segment + 1) * OFFLINE_SEGMENT_RECORDS;
+                continue;
+            }
+            // Decoding always starts at the segment's first record; catch up to the position
+            if (record.seq < _position) {
+                continue;
+            }
+            _position = record.seq + 1;
+            if (damaged) {
+                _store._corrupted++;
+                continue;
+            }
+            return true;
+        }
+        
+        uint8_t data[sizeof(StoredRecord)];
+        if (_file.read(data, sizeof(data)) != sizeof(data)) {
+            return false;
+        }
+        _position++;
+        
+        // A damaged record is skipped rather than stopping the whole drain
+        if (_store.decodeRecord(data, record)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Packed segment decoder
+
+bool FitInfinityOfflineStore::PackedReader::open(FitInfinityOfflineStore& store, uint32_t segment) {
+    _file = store._fs->open(store.segmentPath(segment, "sgz"));
+    if (!_file) {
+        return false;
+    }
+    
+    PackedHeader header;
+    if (_file.read((uint8_t*)&header, sizeof(header)) != sizeof(header) ||
+        header.magic != PACKED_MAGIC || header.version != OFFLINE_PACKED_VERSION ||
+        header.segment != segment || header.count > OFFLINE_SEGMENT_RECORDS) {
+        _file.close();
+        return false;
+    }
+    
+    // Verify the whole body first: a bad byte would throw every later varint off
+    uint32_t crc = 0;
+    uint32_t remaining = header.length;
+    while (remaining > 0) {
+        size_t chunk = _file.read(_buffer, min(remaining, (uint32_t)sizeof(_buffer)));
+        if (chunk == 0) break;
+        crc = crc32Update(crc, _buffer, chunk);
+        remaining -= chunk;
+    }
+    if (remaining > 0 || crc != header.crc || !_file.seek(sizeof(header))) {
+        store._corrupted += header.count;
+        _file.close();
+        return false;
+    }
+    
+    _first = segment * OFFLINE_SEGMENT_RECORDS;
+    _epoch = 0;
+    _remaining = header.length;
+    _index = 0;
+    _count = header.count;
+    _length = _offset = 0;
+    return true;
+}
+
+bool FitInfinityOfflineStore::PackedReader::next(OfflineRecord& record, bool& damaged) {
+    if (!_file || _index >= _count) {
+        return false;
+    }
+    
+    int type = readByte();
+    if (type < 0) {
+        return false;
+    }
+    record.seq = _first + _index++;
+    damaged = (type == PACKED_DAMAGED);
+    if (damaged) {
+        return true;
+    }
+    
+    uint32_t zigzag;
+    int idLength;
+    if (!readVarint(zigzag) || (idLength = readByte()) < 0 || idLength >= (int)sizeof(record.id)) {
+        return false;
+    }
+    _epoch += (zigzag >> 1) ^ -(zigzag & 1);
+    record.epoch = _epoch;
+    record.type = type;
+    for (int i = 0; i < idLength; i++) {
+        int c = readByte();
+        if (c < 0) {
+            return false;
+        }
+        record.id[i] = (char)c;
+    }
+    record.id[idLength] = '\0';
+    return true;
+}
+
+int FitInfinityOfflineStore::PackedReader::readByte() {
+    if (_offset == _length) {
+        if (_remaining == 0) {
+            return -1;
+        }
+        _length = _file.read(_buffer, min(_remaining, (uint32_t)sizeof(_buffer)));
+        if (_length == 0) {
+            return -1;
+        }
+        _remaining -= _length;
+        _offset = 0;
+    }
+    return _buffer[_offset++];
+}
+
+bool FitInfinityOfflineStore::PackedReader::readVarint(uint32_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        int c = readByte();
+        if (c < 0) {
+            return false;
+        }
+        value |= (uint32_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
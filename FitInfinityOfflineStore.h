@@ -0,0 +1,192 @@
+#ifndef FitInfinityOfflineStore_h
+#define FitInfinityOfflineStore_h
+
+#include <Arduino.h>
+#include <FS.h>
+
+#ifndef OFFLINE_SEGMENT_RECORDS
+#define OFFLINE_SEGMENT_RECORDS 256
+#endif
+
+#define OFFLINE_FORMAT_VERSION 2
+#define OFFLINE_PACKED_VERSION 1
+
+// Defaults for the optional RAM tier in front of the files
+#ifndef OFFLINE_SPILL_RECORDS
+#define OFFLINE_SPILL_RECORDS 16
+#endif
+
+#ifndef OFFLINE_SPILL_DELAY
+#define OFFLINE_SPILL_DELAY 30000
+#endif
+
+// Stores flushed by the restart handler; a benchmark or migration may open a second one
+#ifndef OFFLINE_SHUTDOWN_STORES
+#define OFFLINE_SHUTDOWN_STORES 4
+#endif
+
+enum OfflineRecordType : uint8_t {
+    OFFLINE_UNKNOWN = 0,
+    OFFLINE_FINGERPRINT = 1,
+    OFFLINE_RFID = 2
+};
+
+// One stored attendance punch
+struct OfflineRecord {
+    uint32_t seq;               // position in the log; record N is always at index N
+    uint32_t epoch;             // seconds since 1970 UTC, 0 when the clock was not set
+    uint8_t type;               // OfflineRecordType
+    char id[24];
+};
+
+// Queue-depth snapshot, kept up to date as records come and go
+struct OfflineStats {
+    uint32_t pending;           // stored plus buffered in RAM
+    uint32_t buffered;          // in RAM, not yet written to the files
+    uint32_t oldestEpoch;       // 0 when empty or the clock was not set
+    uint32_t newestEpoch;
+    uint32_t bytes;             // used on the storage medium
+    uint32_t segments;
+    uint32_t delivered;         // committed over the life of the store
+    uint32_t drainRate;         // records committed per minute, recent window
+    uint32_t corrupted;
+};
+
+// Append-only offline log of fixed-size binary records, split into segment files of
+// OFFLINE_SEGMENT_RECORDS records. Record N lives at a computable offset in segment
+// N / OFFLINE_SEGMENT_RECORDS, so any record can be read directly by index.
+// Delivered records are skipped by moving a persisted read cursor, and a segment file
+// is deleted once the cursor has passed its end, so draining never rewrites data.
+// During a long outage, sealed segments queued behind the one being drained are packed
+// (delta timestamps, varints, unpadded IDs) and decoded again as they are read.
+class FitInfinityOfflineStore {
+    // Sequential decoder for a packed segment, verified against its CRC on open
+    class PackedReader {
+      public:
+        PackedReader() : _index(0), _count(0) {}
+        bool open(FitInfinityOfflineStore& store, uint32_t segment);
+        bool next(OfflineRecord& record, bool& damaged);
+        bool isOpen() { return (bool)_file; }
+        void close() { _file.close(); }
+        uint32_t index() const { return _index; }  // records decoded so far
+      
+      private:
+        int readByte();
+        bool readVarint(uint32_t& value);
+        
+        File _file;
+        uint32_t _first;            // index of the segment's first record
+        uint32_t _epoch;            // previous record's timestamp, base of the next delta
+        uint32_t _remaining;        // body bytes not yet buffered
+        uint16_t _index;
+        uint16_t _count;
+        uint8_t _buffer[64];
+        uint8_t _length;
+        uint8_t _offset;
+    };
+    
+  public:
+    // Walks records from the read cursor, or from a later index when resuming a drain;
+    // pass position() to commit() once they are delivered
+    class Reader {
+      public:
+        explicit Reader(FitInfinityOfflineStore& store);
+        Reader(FitInfinityOfflineStore& store, uint32_t start);
+        bool next(OfflineRecord& record);
+        uint32_t position() const { return _position; }
+      
+      private:
+        FitInfinityOfflineStore& _store;
+        uint32_t _position;
+        uint32_t _segment;
+        File _file;
+        PackedReader _packed;
+    };
+    
+    explicit FitInfinityOfflineStore(const char* directory = "/offline");
+    ~FitInfinityOfflineStore();
+    
+    bool begin(fs::FS& fs);
+    bool isReady();
+    bool append(uint8_t type, const char* id, uint32_t epoch);
+    
+    // RAM tier: appends collect in memory (PSRAM when present) and reach the files in
+    // batches of spillRecords, or once the oldest has waited spillDelayMs. At most that
+    // many records are lost on a power cut; flush() writes them out immediately, and
+    // ESP.restart() flushes through a shutdown handler.
+    bool setMemoryTier(size_t capacity, uint16_t spillRecords = OFFLINE_SPILL_RECORDS,
+                       unsigned long spillDelayMs = OFFLINE_SPILL_DELAY);
+    void setSpillPolicy(uint16_t spillRecords, unsigned long spillDelayMs);
+    bool flush();
+    void maintain();            // spills due records and packs one sealed segment
+    void setPacking(bool enabled);
+    uint32_t pack(uint32_t maxSegments);
+    void close();               // flush and release the open segment file
+    bool read(uint32_t index, OfflineRecord& record);
+    bool commit(uint32_t index);
+    uint32_t head();            // index of the oldest undelivered record
+    uint32_t tail();            // index the next stored record will get
+    uint32_t pending();         // stored plus buffered in RAM
+    uint32_t segmentCount();
+    uint32_t corrupted();       // records skipped because their CRC did not match
+    void countCorrupted(uint32_t records);  // records a reader's owner had to pass over
+    OfflineStats stats();       // constant time and read-only; never touches the files
+    
+    // Conversions between the stored form and the API's strings
+    static uint8_t parseType(const char* type);
+    static const char* typeName(uint8_t type);
+    static uint32_t parseTimestamp(const char* timestamp);
+    static void formatTimestamp(uint32_t epoch, char* buffer, size_t size);
+  
+  private:
+    fs::FS* _fs;
+    const char* _directory;
+    File _appendFile;               // newest segment, kept open between group commits
+    uint32_t _read;
+    uint32_t _write;
+    uint32_t _corrupted;
+    uint32_t _bytes;                // on the medium, kept current instead of stat'ing files
+    uint32_t _packNext;             // next segment to consider for packing
+    bool _packing;
+    
+    // Index persisted with the cursor, or recovered from the ends of the log on begin
+    uint32_t _oldestEpoch;          // of the record at the read cursor
+    uint32_t _newestEpoch;          // of the last record written
+    uint32_t _delivered;
+    uint32_t _cursorGeneration;     // of the newest cursor slot on disk
+    uint32_t _drainCount;           // committed in the current rate window
+    uint32_t _drainRate;
+    unsigned long _drainSince;
+    
+    OfflineRecord* _memory;
+    size_t _memoryCapacity;
+    size_t _memoryHead;
+    size_t _memoryCount;
+    uint16_t _spillRecords;
+    unsigned long _spillDelay;
+    unsigned long _memorySince;     // when the oldest buffered record arrived
+    
+    String segmentPath(uint32_t segment, const char* extension = "seg");
+    bool packSegment(uint32_t segment);
+    void removeSegment(uint32_t segment);
+    void removeFile(const String& path);
+    bool openForAppend();
+    bool writeRecord(const OfflineRecord& record);
+    bool openSegment(uint32_t segment, File& file);
+    bool decodeRecord(const uint8_t* data, OfflineRecord& record);
+    void recoverWritePosition(uint32_t segment);
+    uint32_t sealTornRecord(File& file);
+    String cursorPath(uint8_t slot);
+    bool loadCursor(uint32_t& read, bool& indexed);
+    void recoverIndex(bool indexed);
+    void updateDrainRate();
+    bool saveCursor();
+    
+    void registerForShutdown();
+    
+    static FitInfinityOfflineStore* _shutdownStores[OFFLINE_SHUTDOWN_STORES];
+    static bool _shutdownRegistered;
+    static void flushOnShutdown();
+};
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef FitInfinityRing_h
+#define FitInfinityRing_h
+
+#include <Arduino.h>
+#include <atomic>
+
+// Single-producer/single-consumer ring buffer, safe between two tasks without locks.
+// Only one task may push/reserve and only one other task may front/pop.
+template <typename T, size_t N>
+class FitInfinityRing {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "FitInfinityRing size must be a power of two");
+
+  public:
+    FitInfinityRing() : _head(0), _tail(0) {}
+
+    // Producer: claim the next free slot to fill in place, or nullptr when full
+    T* reserve() {
+        uint32_t tail = _tail.load(std::memory_order_relaxed);
+        if (tail - _head.load(std::memory_order_acquire) >= N) {
+            return nullptr;
+        }
+        return &_items[tail & (N - 1)];
+    }
+
+    // Producer: publish the slot returned by reserve()
+    void commit() {
+        _tail.store(_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    bool push(const T& item) {
+        T* slot = reserve();
+        if (!slot) {
+            return false;
+        }
+        *slot = item;
+        commit();
+        return true;
+    }
+
+    // Consumer: oldest item, or nullptr when empty
+    T* front() {
+        uint32_t head = _head.load(std::memory_order_relaxed);
+        if (head == _tail.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        return &_items[head & (N - 1)];
+    }
+
+    // Consumer: release the item returned by front()
+    void pop() {
+        _head.store(_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    size_t size() const {
+        return _tail.load(std::memory_order_acquire) - _head.load(std::memory_order_acquire);
+    }
+
+  private:
+    T _items[N];
+    std::atomic<uint32_t> _head;  // next slot to read, written by the consumer
+    std::atomic<uint32_t> _tail;  // next slot to write, written by the producer
+};
+
+#endif
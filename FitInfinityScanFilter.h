@@ -0,0 +1,106 @@
+#ifndef FitInfinityScanFilter_h
+#define FitInfinityScanFilter_h
+
+#include <Arduino.h>
+
+// Drops repeat scans of the same finger or card within a time window.
+// Remembers the N most recently seen (type, id) pairs by hash; when full, the
+// least recently seen pair is forgotten. Only scans passed to record() count, so
+// callers check isRepeat() first and record once the scan is logged or stored.
+// Fixed memory, no heap.
+template <size_t N>
+class FitInfinityScanFilter {
+    static_assert(N > 0, "FitInfinityScanFilter needs at least one entry");
+
+  public:
+    explicit FitInfinityScanFilter(unsigned long windowMs) : _window(windowMs), _count(0), _suppressed(0) {}
+
+    void setWindow(unsigned long windowMs) {
+        _window = windowMs;
+    }
+
+    // True for a repeat of a recorded scan inside the window; it is counted and refused.
+    // Every sighting restarts the window, so a finger held on the sensor stays suppressed.
+    bool isRepeat(const char* type, const char* id, unsigned long now) {
+        if (_window == 0) {
+            return false;
+        }
+
+        Entry* entry = find(hash(type, id));
+        if (!entry || now - entry->seenAt >= _window) {
+            return false;
+        }
+        entry->seenAt = now;
+        _suppressed++;
+        return true;
+    }
+
+    // Starts the window for a scan once it has been logged or stored, so a scan that
+    // failed is not suppressed when the member tries again
+    void record(const char* type, const char* id, unsigned long now) {
+        if (_window == 0) {
+            return;
+        }
+
+        uint32_t key = hash(type, id);
+        Entry* entry = find(key);
+        if (!entry) {
+            // New pair: take a free slot, else evict the least recently seen
+            size_t oldest = 0;
+            for (size_t i = 1; i < _count; i++) {
+                if ((long)(_entries[i].seenAt - _entries[oldest].seenAt) < 0) {
+                    oldest = i;
+                }
+            }
+            entry = &_entries[_count < N ? _count++ : oldest];
+            entry->key = key;
+        }
+        entry->seenAt = now;
+    }
+
+    // Drops a recorded scan again, for one that was marked while in flight and then failed
+    void forget(const char* type, const char* id) {
+        Entry* entry = find(hash(type, id));
+        if (entry) {
+            *entry = _entries[--_count];
+        }
+    }
+
+    uint32_t suppressed() const {
+        return _suppressed;
+    }
+
+  private:
+    struct Entry {
+        uint32_t key;               // FNV-1a of type, NUL, id
+        unsigned long seenAt;
+    };
+
+    Entry* find(uint32_t key) {
+        for (size_t i = 0; i < _count; i++) {
+            if (_entries[i].key == key) {
+                return &_entries[i];
+            }
+        }
+        return nullptr;
+    }
+
+    static uint32_t hash(const char* type, const char* id) {
+        uint32_t h = 2166136261UL;
+        for (const char* p = type; *p; p++) {
+            h = (h ^ (uint8_t)*p) * 16777619UL;
+        }
+        h *= 16777619UL;
+        for (const char* p = id; *p; p++) {
+            h = (h ^ (uint8_t)*p) * 16777619UL;
+        }
+        return h;
+    }
+
+    Entry _entries[N];
+    unsigned long _window;
+    size_t _count;
+    uint32_t _suppressed;
+};
+
+#endif
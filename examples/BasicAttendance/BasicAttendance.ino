@@ -28,6 +28,9 @@ void setup() {
 }
 
 void loop() {
+    // Write offline punches buffered in RAM out to storage
+    api.apiLoop();
+
     // Simulate fingerprint detection
     if (Serial.available()) {
         String input = Serial.readStringUntil('\n');
@@ -0,0 +1,232 @@
+#include <FitInfinityMQTT.h>
+
+// On-device performance benchmark for the FitInfinity library.
+// Run it on a bench unit before rolling a build out to the fleet and compare
+// the numbers against the previous release.
+//
+// Dispatch is measured without a broker. Publish paths need a reachable
+// broker, and offline store/sync needs an SD card (or falls back to memory).
+
+// Device configuration
+const char* deviceId = "ESP32_BENCH";
+const char* baseUrl = "https://your-fitinfinity-domain.com";
+const char* accessKey = "your-access-key";
+
+// Network configuration
+const char* ssid = "your_wifi_ssid";
+const char* password = "your_wifi_password";
+const char* mqttServer = "your-mqtt-server";
+const int mqttPort = 1883;
+const char* mqttUsername = "fitinfinity_mqtt";
+const char* mqttPassword = "your-mqtt-password";
+
+// Benchmark sizes
+const int DISPATCH_ITERATIONS = 2000;
+const int PUBLISH_ITERATIONS = 200;
+const int OFFLINE_RECORDS = 1000;
+const int BULK_RECORDS = 100;
+const uint32_t PACK_RECORDS = 100000;
+const int SD_CS_PIN = 5;
+
+FitInfinityMQTT api(baseUrl, deviceId, accessKey);
+
+volatile uint32_t handled = 0;
+
+void onBenchMessage(const char* topic, JsonVariant payload) {
+    handled += payload["n"].as<int>() > 0 ? 1 : 0;
+}
+
+void report(const char* name, unsigned long elapsedMicros, int iterations, uint32_t heapBefore) {
+    Serial.printf("%-28s %8lu us total %8.1f us/op  max block %6u -> %6u\n",
+                  name, elapsedMicros, (float)elapsedMicros / iterations,
+                  heapBefore, ESP.getMaxAllocHeap());
+}
+
+void benchDispatch() {
+    Serial.println("\n== Inbound dispatch ==");
+
+    String routed = "fitinfinity/devices/" + String(deviceId) + "/bench/echo";
+    String unrouted = "fitinfinity/devices/" + String(deviceId) + "/bench/nobody";
+    const char json[] = "{\"n\":1,\"employeeId\":\"EMP001\",\"name\":\"Benchmark User\"}";
+    const char msgpack[] = {(char)0x81, (char)0xa1, 'n', 0x01};  // {"n":1}
+
+    struct {
+        const char* name;
+        const char* topic;
+        const char* payload;
+        size_t length;
+    } cases[] = {
+        {"dispatch json", routed.c_str(), json, sizeof(json) - 1},
+        {"dispatch msgpack", routed.c_str(), msgpack, sizeof(msgpack)},
+        {"dispatch unrouted", unrouted.c_str(), json, sizeof(json) - 1},
+    };
+
+    for (auto& c : cases) {
+        api.resetDispatchStats();
+        uint32_t heapBefore = ESP.getMaxAllocHeap();
+        unsigned long started = micros();
+        for (int i = 0; i < DISPATCH_ITERATIONS; i++) {
+            api.injectMessage(c.topic, c.payload, c.length);
+        }
+        report(c.name, micros() - started, DISPATCH_ITERATIONS, heapBefore);
+
+        MqttDispatchStats stats = api.getDispatchStats();
+        Serial.printf("  in-dispatch avg %.1f us, max %u us, parse errors %u\n",
+                      stats.messages ? (float)stats.totalMicros / stats.messages : 0.0f,
+                      stats.maxMicros, stats.parseErrors);
+    }
+}
+
+void benchPublish() {
+    Serial.println("\n== Publish paths ==");
+    if (!api.isMQTTConnected()) {
+        Serial.println("MQTT not connected, skipped");
+        return;
+    }
+
+    uint32_t heapBefore = ESP.getMaxAllocHeap();
+    unsigned long started = micros();
+    for (int i = 0; i < PUBLISH_ITERATIONS; i++) api.publishHeartbeat();
+    report("publishHeartbeat", micros() - started, PUBLISH_ITERATIONS, heapBefore);
+
+    heapBefore = ESP.getMaxAllocHeap();
+    started = micros();
+    for (int i = 0; i < PUBLISH_ITERATIONS; i++) api.publishDeviceStatus("online");
+    report("publishDeviceStatus", micros() - started, PUBLISH_ITERATIONS, heapBefore);
+
+    heapBefore = ESP.getMaxAllocHeap();
+    started = micros();
+    for (int i = 0; i < PUBLISH_ITERATIONS; i++) api.publishDeviceMetrics();
+    report("publishDeviceMetrics", micros() - started, PUBLISH_ITERATIONS, heapBefore);
+
+    heapBefore = ESP.getMaxAllocHeap();
+    started = micros();
+    for (int i = 0; i < PUBLISH_ITERATIONS; i++) api.publishEnrollmentStatus("EMP001", "completed", 1);
+    report("publishEnrollmentStatus", micros() - started, PUBLISH_ITERATIONS, heapBefore);
+
+    heapBefore = ESP.getMaxAllocHeap();
+    started = micros();
+    for (int i = 0; i < PUBLISH_ITERATIONS; i++) {
+        api.publishAttendanceLog("rfid", String(i).c_str(), api.getTimestamp());
+        api.mqttLoop();
+    }
+    report("publishAttendanceLog", micros() - started, PUBLISH_ITERATIONS, heapBefore);
+
+    DynamicJsonDocument bulk(JSON_ARRAY_SIZE(BULK_RECORDS) + BULK_RECORDS * JSON_OBJECT_SIZE(3));
+    JsonArray records = bulk.to<JsonArray>();
+    for (int i = 0; i < BULK_RECORDS; i++) {
+        JsonObject record = records.createNestedObject();
+        record["type"] = "fingerprint";
+        record["id"] = i;
+        record["timestamp"] = "2024-01-01T00:00:00.000Z";
+    }
+    heapBefore = ESP.getMaxAllocHeap();
+    started = micros();
+    api.publishBulkAttendanceData(records);
+    report("publishBulkAttendanceData", micros() - started, BULK_RECORDS, heapBefore);
+
+    Serial.printf("  publish overflows %u, outbox pending %u\n",
+                  api.getPublishOverflows(), api.getOutboxPending());
+}
+
+void benchOfflineStore() {
+    Serial.println("\n== Offline store ==");
+
+    // Every punch committed on its own, then group commit with the default thresholds
+    api.setOfflineCommitPolicy(1, 0);
+    uint32_t heapBefore = ESP.getMaxAllocHeap();
+    unsigned long started = micros();
+    for (int i = 0; i < OFFLINE_RECORDS; i++) {
+        api.storeOfflineRecord("fingerprint", String(i).c_str(), "2024-01-01T00:00:00.000Z");
+    }
+    report("storeOfflineRecord (each)", micros() - started, OFFLINE_RECORDS, heapBefore);
+
+    api.setOfflineCommitPolicy(OFFLINE_SPILL_RECORDS, OFFLINE_SPILL_DELAY);
+    heapBefore = ESP.getMaxAllocHeap();
+    started = micros();
+    for (int i = 0; i < OFFLINE_RECORDS; i++) {
+        api.storeOfflineRecord("fingerprint", String(i).c_str(), "2024-01-01T00:00:00.000Z");
+    }
+    api.flushOfflineRecords();
+    report("storeOfflineRecord (group)", micros() - started, OFFLINE_RECORDS, heapBefore);
+    Serial.println("  " + api.getOfflineStorageStats());
+
+    heapBefore = ESP.getMaxAllocHeap();
+    started = micros();
+    bool synced = api.syncOfflineRecords();
+    report("syncOfflineRecords", micros() - started, OFFLINE_RECORDS, heapBefore);
+    Serial.println(synced ? "  sync completed" : "  sync failed: " + api.getLastError());
+}
+
+void benchPacking() {
+    Serial.println("\n== Offline segment packing ==");
+
+    // A separate directory, so the library's own backlog is left alone
+    FitInfinityOfflineStore log("/bench");
+    if (!log.begin(SD) || !log.setMemoryTier(OFFLINE_SEGMENT_RECORDS, OFFLINE_SEGMENT_RECORDS, 60000)) {
+        Serial.println("SD card not available, skipped");
+        return;
+    }
+    log.setPacking(false);
+
+    // Synthetic outage: 500 members punching every few seconds
+    uint32_t epoch = 1704067200;
+    char id[16];
+    unsigned long started = micros();
+    for (uint32_t i = 0; i < PACK_RECORDS; i++) {
+        snprintf(id, sizeof(id), "%08lX", 0x3A000000UL + random(500));
+        epoch += random(1, 30);
+        log.append(random(2) ? OFFLINE_RFID : OFFLINE_FINGERPRINT, id, epoch);
+    }
+    log.flush();
+    report("append", micros() - started, PACK_RECORDS, ESP.getMaxAllocHeap());
+    uint32_t plainBytes = log.stats().bytes;
+
+    started = micros();
+    uint32_t segments = log.pack(UINT32_MAX);
+    unsigned long elapsed = micros() - started;
+    uint32_t packedBytes = log.stats().bytes;
+    report("pack", elapsed, PACK_RECORDS, ESP.getMaxAllocHeap());
+    Serial.printf("  %u segments, %u -> %u bytes (%.2fx), %.1f KB/s in\n",
+                  segments, plainBytes, packedBytes, (float)plainBytes / packedBytes,
+                  plainBytes / 1024.0f / (elapsed / 1e6f));
+
+    OfflineRecord record;
+    uint32_t count = 0;
+    FitInfinityOfflineStore::Reader reader(log);
+    started = micros();
+    while (reader.next(record)) {
+        count++;
+    }
+    elapsed = micros() - started;
+    report("read back", elapsed, count, ESP.getMaxAllocHeap());
+    Serial.printf("  %u records, %.0f records/s, %u corrupted\n",
+                  count, count / (elapsed / 1e6f), log.corrupted());
+
+    log.commit(log.tail());
+}
+
+void setup() {
+    Serial.begin(115200);
+    delay(1000);
+    Serial.println("FitInfinity benchmark");
+
+    api.onTopic("/bench/echo", onBenchMessage);
+    benchDispatch();
+
+    if (api.begin(ssid, password, SD_CS_PIN)) {
+        api.connectMQTT(mqttServer, mqttPort, mqttUsername, mqttPassword);
+    } else {
+        Serial.println("Network unavailable: " + api.getLastError());
+    }
+
+    benchPublish();
+    benchOfflineStore();
+    benchPacking();
+
+    Serial.printf("\nHandled %u routed messages, free heap %u\n", handled, ESP.getFreeHeap());
+}
+
+void loop() {
+    api.mqttLoop();
+}
@@ -149,8 +149,11 @@ void setup() {
 }
 
 void loop() {
-  // Check for pending enrollments
-  DynamicJsonDocument doc(1024);
+  // Write offline punches buffered in RAM out to storage
+  api.apiLoop();
+
+  // Check for pending enrollments; a page holds up to ENROLLMENT_PAGE_SIZE of them
+  DynamicJsonDocument doc(4096);
   JsonArray enrollments = doc.to<JsonArray>();
 
   // Manage I2C usage: only allow access every 200ms
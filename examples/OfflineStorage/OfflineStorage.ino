@@ -34,6 +34,9 @@ void setup() {
 }
 
 void loop() {
+    // Write offline punches buffered in RAM out to storage
+    api.apiLoop();
+
     // Example fingerprint detection
     if (Serial.available()) {
         String input = Serial.readStringUntil('\n');
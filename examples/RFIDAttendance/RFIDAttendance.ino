@@ -52,6 +52,9 @@ void setup() {
 }
 
 void loop() {
+  // Write offline punches buffered in RAM out to storage
+  api.apiLoop();
+
   // Regular attendance monitoring
   if (api.isConnected()) {
     // Buffer for storing RFID card ID
@@ -0,0 +1,105 @@
+#include <FitInfinityOfflineStore.h>
+
+// Host benchmark for the offline store: per-punch cost of write-through against group
+// commit, and the read, commit and packing work a sync does. Runs against the in-memory
+// FS, so the times are host CPU time only; flash program and erase latency is not in
+// them. "changes" counts flushes, creates, renames and removes reaching the medium,
+// which is what costs a metadata commit on LittleFS or a FAT update on SD.
+
+static const uint32_t PUNCHES = 20000;
+static const uint32_t SYNC_BATCH = 32;          // records per drain batch, as over MQTT
+static const uint32_t EPOCH = 1704067200;
+
+static void report(const char* name, unsigned long elapsedMicros, unsigned long changes, uint32_t count,
+                   const char* unit) {
+    printf("%-34s %9.2f us/%s %8.3f changes/%s\n", name, (double)elapsedMicros / count, unit,
+           (double)changes / count, unit);
+}
+
+static void appendPunches(FitInfinityOfflineStore& store, uint32_t count) {
+    char id[16];
+    for (uint32_t i = 0; i < count; i++) {
+        snprintf(id, sizeof(id), "EMP%05u", (unsigned)i);
+        store.append(i % 2 ? OFFLINE_RFID : OFFLINE_FINGERPRINT, id, EPOCH + i);
+    }
+}
+
+// Punches stored one by one, then the flush a restart or the spill delay would do
+static void benchAppend(const char* name, size_t capacity, uint16_t spillRecords) {
+    FS fs;
+    FitInfinityOfflineStore store;
+    store.begin(fs);
+    store.setPacking(false);
+    if (capacity > 0) {
+        store.setMemoryTier(capacity, spillRecords, OFFLINE_SPILL_DELAY);
+    }
+
+    unsigned long changes = fs.operations();
+    unsigned long started = micros();
+    appendPunches(store, PUNCHES);
+    store.flush();
+    report(name, micros() - started, fs.operations() - changes, PUNCHES, "punch");
+}
+
+// Reads the backlog back in drain-sized batches and commits each one, as a sync does
+static void benchSync(bool packed) {
+    FS fs;
+    FitInfinityOfflineStore store;
+    store.begin(fs);
+    store.setPacking(false);
+    store.setMemoryTier(64, OFFLINE_SPILL_RECORDS, OFFLINE_SPILL_DELAY);
+    appendPunches(store, PUNCHES);
+    store.flush();
+
+    if (packed) {
+        unsigned long changes = fs.operations();
+        unsigned long started = micros();
+        uint32_t segments = store.pack(UINT32_MAX);
+        report("pack sealed segments", micros() - started, fs.operations() - changes, segments, "segment");
+    }
+
+    unsigned long readMicros = 0;
+    unsigned long commitMicros = 0;
+    unsigned long commitChanges = 0;
+    uint32_t batches = 0;
+    uint32_t records = 0;
+    OfflineRecord record;
+    while (store.head() < store.tail()) {
+        unsigned long started = micros();
+        FitInfinityOfflineStore::Reader reader(store);
+        uint32_t count = 0;
+        while (count < SYNC_BATCH && reader.next(record)) {
+            count++;
+        }
+        readMicros += micros() - started;
+        records += count;
+
+        unsigned long changes = fs.operations();
+        started = micros();
+        if (!store.commit(reader.position())) {
+            printf("commit failed at %u\n", (unsigned)reader.position());
+            return;
+        }
+        commitMicros += micros() - started;
+        commitChanges += fs.operations() - changes;
+        batches++;
+    }
+
+    report(packed ? "read packed backlog" : "read plain backlog", readMicros, 0, records, "record");
+    report(packed ? "commit batch (packed)" : "commit batch (plain)", commitMicros, commitChanges, batches, "batch");
+}
+
+int main() {
+    printf("== Offline store, %u punches, %u-record segments (host-measured)\n",
+           (unsigned)PUNCHES, (unsigned)OFFLINE_SEGMENT_RECORDS);
+    benchAppend("append write-through", 0, 1);
+    benchAppend("append group commit, 1", 64, 1);
+    benchAppend("append group commit, 4", 64, 4);
+    benchAppend("append group commit, 16 (default)", 64, OFFLINE_SPILL_RECORDS);
+    benchAppend("append group commit, 64", 64, 64);
+
+    printf("\n== Sync, %u-record batches (host-measured)\n", (unsigned)SYNC_BATCH);
+    benchSync(false);
+    benchSync(true);
+    return 0;
+}
@@ -0,0 +1,50 @@
+#include "Arduino.h"
+#include "esp_system.h"
+#include <chrono>
+#include <vector>
+
+unsigned long mockMillis = 0;
+MockSerial Serial;
+
+static std::vector<shutdown_handler_t> shutdownHandlers;
+
+unsigned long millis() {
+    return mockMillis;
+}
+
+unsigned long micros() {
+    // Real time, for bench_offline_store; millis() stays under test control
+    using namespace std::chrono;
+    return (unsigned long)duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+void delay(unsigned long ms) {
+    mockMillis += ms;
+}
+
+long random(long howBig) {
+    return howBig > 0 ? rand() % howBig : 0;
+}
+
+long random(long howSmall, long howBig) {
+    return howBig > howSmall ? howSmall + random(howBig - howSmall) : howSmall;
+}
+
+bool psramFound() {
+    return false;
+}
+
+void* ps_malloc(size_t size) {
+    return malloc(size);
+}
+
+esp_err_t esp_register_shutdown_handler(shutdown_handler_t handler) {
+    shutdownHandlers.push_back(handler);
+    return ESP_OK;
+}
+
+void mockRestart() {
+    for (shutdown_handler_t handler : shutdownHandlers) {
+        handler();
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef MockArduino_h
+#define MockArduino_h
+
+// Just enough of the ESP32 Arduino core to build the library's platform-free parts on a
+// PC: String, Serial, a settable clock and the PSRAM allocators
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <algorithm>
+#include <cmath>
+#include <string>
+
+using std::max;
+using std::min;
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+typedef uint8_t byte;
+
+// The clock only moves when a test moves it, or through delay()
+extern unsigned long mockMillis;
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+long random(long howBig);
+long random(long howSmall, long howBig);
+
+bool psramFound();
+void* ps_malloc(size_t size);
+
+class String {
+  public:
+    String() {}
+    String(const char* text) : _text(text ? text : "") {}
+    String(const std::string& text) : _text(text) {}
+    explicit String(int value) : _text(std::to_string(value)) {}
+    explicit String(unsigned int value) : _text(std::to_string(value)) {}
+    explicit String(long value) : _text(std::to_string(value)) {}
+    explicit String(unsigned long value) : _text(std::to_string(value)) {}
+
+    const char* c_str() const { return _text.c_str(); }
+    unsigned int length() const { return _text.length(); }
+
+    String& operator+=(const String& other) {
+        _text += other._text;
+        return *this;
+    }
+    bool operator==(const String& other) const { return _text == other._text; }
+    bool operator!=(const String& other) const { return _text != other._text; }
+
+    friend String operator+(const String& a, const String& b) { return String(a._text + b._text); }
+    friend String operator+(const String& a, const char* b) { return String(a._text + b); }
+    friend String operator+(const char* a, const String& b) { return String(a + b._text); }
+
+  private:
+    std::string _text;
+};
+
+class MockSerial {
+  public:
+    // Quiet unless a test asks for the library's log lines
+    bool echo = false;
+
+    void println(const String& line) {
+        if (echo) puts(line.c_str());
+    }
+    void println(const char* line) {
+        if (echo) puts(line);
+    }
+};
+
+extern MockSerial Serial;
+
+#endif
@@ -0,0 +1,209 @@
+#include "FS.h"
+
+namespace fs {
+
+static std::string parentOf(const std::string& path) {
+    size_t slash = path.rfind('/');
+    return slash == 0 || slash == std::string::npos ? "/" : path.substr(0, slash);
+}
+
+static std::string baseName(const std::string& path) {
+    size_t slash = path.rfind('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+bool FileImpl::commit() {
+    if (pending.empty()) {
+        return true;
+    }
+
+    // The cut flush keeps the first half of its bytes, like a flash page program cut short
+    size_t length = pending.size();
+    bool torn = false;
+    if (!fs->change(&torn)) {
+        if (!torn) {
+            pending.clear();
+            return false;
+        }
+        length /= 2;
+    }
+
+    if (pendingAt + length > data->size()) {
+        data->resize(pendingAt + length);
+    }
+    memcpy(data->data() + pendingAt, pending.data(), length);
+    pending.clear();
+    return !torn;
+}
+
+size_t File::read(uint8_t* buffer, size_t size) {
+    if (!_impl || !_impl->data) {
+        return 0;
+    }
+    _impl->commit();
+    if (_impl->position >= _impl->data->size()) {
+        return 0;
+    }
+    size_t length = min(size, _impl->data->size() - _impl->position);
+    memcpy(buffer, _impl->data->data() + _impl->position, length);
+    _impl->position += length;
+    return length;
+}
+
+size_t File::write(const uint8_t* buffer, size_t size) {
+    if (!_impl || !_impl->data || size == 0) {
+        return 0;
+    }
+
+    FileImpl& impl = *_impl;
+    size_t at = impl.position;
+    if (impl.append) {
+        at = impl.pending.empty() ? impl.data->size() : impl.pendingAt + impl.pending.size();
+    }
+
+    // Only a contiguous run is buffered; writing elsewhere flushes it first
+    if (!impl.pending.empty() && at != impl.pendingAt + impl.pending.size() && !impl.commit()) {
+        return 0;
+    }
+    if (impl.pending.empty()) {
+        impl.pendingAt = at;
+    }
+    impl.pending.insert(impl.pending.end(), buffer, buffer + size);
+    impl.position = at + size;
+    return size;
+}
+
+bool File::seek(uint32_t position) {
+    if (!_impl || !_impl->data) {
+        return false;
+    }
+    _impl->commit();
+    if (position > _impl->data->size()) {
+        return false;
+    }
+    _impl->position = position;
+    return true;
+}
+
+size_t File::size() const {
+    if (!_impl || !_impl->data) {
+        return 0;
+    }
+    size_t buffered = _impl->pending.empty() ? 0 : _impl->pendingAt + _impl->pending.size();
+    return max(_impl->data->size(), buffered);
+}
+
+File File::openNextFile() {
+    if (!_impl || _impl->data || _impl->nextEntry >= _impl->entries.size()) {
+        return File();
+    }
+    return _impl->fs->open(_impl->entries[_impl->nextEntry++].c_str());
+}
+
+FS::FS() : _remaining(-1), _operations(0) {
+    _directories.insert("/");
+}
+
+File FS::open(const char* path, const char* mode, bool create) {
+    std::string key(path);
+    std::shared_ptr<FileImpl> impl(new FileImpl());
+    impl->fs = this;
+    impl->path = key;
+    impl->name = baseName(key);
+    impl->append = false;
+    impl->position = 0;
+    impl->nextEntry = 0;
+    impl->pendingAt = 0;
+
+    if (_directories.count(key)) {
+        impl->entries = list(path);
+        return File(impl);
+    }
+
+    bool writing = strcmp(mode, FILE_WRITE) == 0;
+    bool appending = strcmp(mode, FILE_APPEND) == 0;
+    auto found = _files.find(key);
+    if (found == _files.end()) {
+        if (!(writing || appending || create) || !_directories.count(parentOf(key)) || !change()) {
+            return File();
+        }
+        found = _files.insert(std::make_pair(key, std::make_shared<std::vector<uint8_t>>())).first;
+    } else if (writing) {
+        if (!change()) {
+            return File();
+        }
+        found->second->clear();
+    }
+
+    impl->data = found->second;
+    impl->append = appending;
+    return File(impl);
+}
+
+bool FS::exists(const char* path) {
+    return _files.count(path) || _directories.count(path);
+}
+
+bool FS::remove(const char* path) {
+    if (!_files.count(path) || !change()) {
+        return false;
+    }
+    _files.erase(path);
+    return true;
+}
+
+bool FS::rename(const char* from, const char* to) {
+    auto found = _files.find(from);
+    if (found == _files.end() || !change()) {
+        return false;
+    }
+    std::shared_ptr<std::vector<uint8_t>> data = found->second;
+    _files.erase(found);
+    _files[to] = data;
+    return true;
+}
+
+bool FS::mkdir(const char* path) {
+    if (!change()) {
+        return false;
+    }
+    _directories.insert(path);
+    return true;
+}
+
+void FS::cutPowerAfter(long operations) {
+    _remaining = operations < 0 ? -1 : operations + 1;
+}
+
+void FS::restorePower() {
+    _remaining = -1;
+}
+
+std::vector<uint8_t>* FS::contents(const char* path) {
+    auto found = _files.find(path);
+    return found == _files.end() ? nullptr : found->second.get();
+}
+
+std::vector<std::string> FS::list(const char* directory) {
+    std::vector<std::string> entries;
+    for (const auto& file : _files) {
+        if (parentOf(file.first) == directory) {
+            entries.push_back(file.first);
+        }
+    }
+    return entries;
+}
+
+bool FS::change(bool* torn) {
+    if (_remaining == 0) {
+        return false;
+    }
+    _operations++;
+    if (_remaining > 0 && --_remaining == 0) {
+        if (torn) *torn = true;
+        return false;
+    }
+    return true;
+}
+
+}  // namespace fs
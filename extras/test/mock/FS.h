@@ -0,0 +1,114 @@
+#ifndef MockFS_h
+#define MockFS_h
+
+// In-memory stand-in for the ESP32 fs::FS and fs::File, with power-cut injection.
+// Writes are buffered per open file and reach the medium on flush(), close(), a seek or
+// read on the same file, or when the last handle goes away. A cut tears the flush in
+// progress in half and fails every change after it until restorePower(), so bytes that
+// were written but never flushed are lost
+#include <Arduino.h>
+#include <map>
+#include <memory>
+#include <set>
+#include <vector>
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+namespace fs {
+
+class FS;
+
+struct FileImpl {
+    FS* fs;
+    std::string path;
+    std::string name;
+    std::shared_ptr<std::vector<uint8_t>> data;     // null for a directory
+    bool append;
+    size_t position;
+    std::vector<std::string> entries;               // directory listing taken on open
+    size_t nextEntry;
+    std::vector<uint8_t> pending;                   // written but not yet flushed
+    size_t pendingAt;                               // offset the pending bytes go to
+
+    ~FileImpl() { commit(); }
+
+    // Moves the pending bytes to the medium as one change; false if the change was cut
+    bool commit();
+};
+
+class File {
+  public:
+    File() {}
+    explicit File(std::shared_ptr<FileImpl> impl) : _impl(impl) {}
+
+    explicit operator bool() const { return (bool)_impl; }
+
+    size_t read(uint8_t* buffer, size_t size);
+    size_t write(const uint8_t* buffer, size_t size);
+    bool seek(uint32_t position);
+    size_t size() const;
+    void flush() {
+        if (_impl) _impl->commit();
+    }
+    void close() {
+        flush();
+        _impl.reset();
+    }
+    const char* name() const { return _impl ? _impl->name.c_str() : ""; }
+    const char* path() const { return _impl ? _impl->path.c_str() : ""; }
+    File openNextFile();
+
+  private:
+    std::shared_ptr<FileImpl> _impl;
+};
+
+class FS {
+  public:
+    FS();
+
+    File open(const char* path, const char* mode = FILE_READ, bool create = false);
+    File open(const String& path, const char* mode = FILE_READ, bool create = false) {
+        return open(path.c_str(), mode, create);
+    }
+    bool exists(const char* path);
+    bool exists(const String& path) { return exists(path.c_str()); }
+    bool remove(const char* path);
+    bool remove(const String& path) { return remove(path.c_str()); }
+    bool rename(const char* from, const char* to);
+    bool rename(const String& from, const String& to) { return rename(from.c_str(), to.c_str()); }
+    bool mkdir(const char* path);
+    bool mkdir(const String& path) { return mkdir(path.c_str()); }
+
+    // Power-cut injection: the operation after the next `operations` changes is cut
+    // (a write keeps its first half); -1 never cuts
+    void cutPowerAfter(long operations);
+    void restorePower();
+    bool powered() const { return _remaining != 0; }
+    unsigned long operations() const { return _operations; }
+
+    // Direct access for tests that damage files on purpose
+    std::vector<uint8_t>* contents(const char* path);
+    std::vector<std::string> list(const char* directory);
+
+  private:
+    friend class File;
+    friend struct FileImpl;
+
+    // Counts one change to the medium; false for the change that is cut, with torn set so
+    // a write can keep part of its bytes, and for every change after it
+    bool change(bool* torn = nullptr);
+
+    std::map<std::string, std::shared_ptr<std::vector<uint8_t>>> _files;
+    std::set<std::string> _directories;
+    long _remaining;
+    unsigned long _operations;
+};
+
+}  // namespace fs
+
+using fs::File;
+using fs::FS;
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef MockEspSystem_h
+#define MockEspSystem_h
+
+typedef int esp_err_t;
+#define ESP_OK 0
+
+typedef void (*shutdown_handler_t)(void);
+
+esp_err_t esp_register_shutdown_handler(shutdown_handler_t handler);
+
+// Runs the registered handlers the way esp_restart() would, without restarting
+void mockRestart();
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef FitInfinityTest_h
+#define FitInfinityTest_h
+
+// Bare-bones checks for the host tests: a failed CHECK is reported and counted,
+// and the test program exits non-zero if any failed
+#include <stdio.h>
+
+static int testFailures = 0;
+
+#define CHECK(condition)                                                        \
+    do {                                                                        \
+        if (!(condition)) {                                                     \
+            printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #condition); \
+            testFailures++;                                                     \
+        }                                                                       \
+    } while (0)
+
+#define RUN(test)                                                               \
+    do {                                                                        \
+        int before = testFailures;                                              \
+        test();                                                                 \
+        printf("%-40s %s\n", #test, testFailures == before ? "ok" : "FAILED"); \
+    } while (0)
+
+static int testResult() {
+    return testFailures == 0 ? 0 : 1;
+}
+
+#endif
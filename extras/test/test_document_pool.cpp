@@ -0,0 +1,68 @@
+#include "test.h"
+#include <FitInfinityDocumentPool.h>
+#include <thread>
+
+typedef FitInfinityDocumentPool<256, 2> Pool;
+
+static void leasesUntilEmpty() {
+    Pool pool;
+    {
+        Pool::Lease first(pool);
+        Pool::Lease second(pool);
+        CHECK(first && second);
+        CHECK(&*first != &*second);
+
+        Pool::Lease third(pool);
+        CHECK(!third);
+        CHECK(pool.exhausted() == 1);
+    }
+
+    // Both came back when their leases went out of scope
+    Pool::Lease again(pool);
+    Pool::Lease andAgain(pool);
+    CHECK(again && andAgain);
+    CHECK(pool.exhausted() == 1);
+}
+
+static void documentsComeBackCleared() {
+    Pool pool;
+    JsonDocument* used;
+    {
+        Pool::Lease lease(pool);
+        (*lease)["status"] = "online";
+        used = &*lease;
+    }
+    Pool::Lease lease(pool);
+    CHECK(&*lease == used);
+    CHECK((*lease).isNull());
+}
+
+static void concurrentLeasesNeverShareADocument() {
+    // Each task publishes the document it holds; the other must never hold the same one
+    static Pool pool;
+    static std::atomic<JsonDocument*> held[2];
+    static std::atomic<bool> shared(false);
+    auto worker = [](int self) {
+        for (int i = 0; i < 100000; i++) {
+            Pool::Lease lease(pool);
+            if (!lease) continue;
+            held[self].store(&*lease);
+            if (held[1 - self].load() == &*lease) {
+                shared = true;
+            }
+            held[self].store(nullptr);
+        }
+    };
+    std::thread a(worker, 0);
+    std::thread b(worker, 1);
+    a.join();
+    b.join();
+    CHECK(!shared);
+}
+
+int main() {
+    RUN(leasesUntilEmpty);
+    RUN(documentsComeBackCleared);
+    RUN(concurrentLeasesNeverShareADocument);
+    return testResult();
+}
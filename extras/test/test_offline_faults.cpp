@@ -0,0 +1,208 @@
+#include "test.h"
+#include <FitInfinityOfflineStore.h>
+#include <esp_system.h>
+#include <map>
+#include <string>
+
+// Power-cut injection: the same run of appends, commits and packing is repeated with the
+// power cut at every change it makes to the medium, then the store is reopened and must
+// hold everything it acknowledged and not yet delivered, in order.
+
+// On the device nothing runs after the cut, so an append or commit only counts as
+// acknowledged if it returned while the medium was still powered.
+
+struct Outcome {
+    std::map<uint32_t, std::string> acknowledged;   // seq -> ID of every append that returned true
+    uint32_t committed;                             // last commit that returned true
+    uint32_t attempted;                             // last commit tried
+};
+
+static void appendSome(FS& fs, FitInfinityOfflineStore& store, Outcome& outcome, uint32_t count, uint32_t& serial) {
+    char id[16];
+    for (uint32_t i = 0; i < count; i++) {
+        snprintf(id, sizeof(id), "C%u", (unsigned)serial++);
+        uint32_t seq = store.tail();
+        if (store.append(OFFLINE_RFID, id, 1704067200 + serial) && fs.powered()) {
+            outcome.acknowledged[seq] = id;
+        }
+    }
+}
+
+static void commitTo(FS& fs, FitInfinityOfflineStore& store, Outcome& outcome, uint32_t index) {
+    outcome.attempted = index;
+    if (store.commit(index) && fs.powered()) {
+        outcome.committed = index;
+    }
+}
+
+// Crosses segment boundaries, packs sealed segments and drains through a packed one
+static void scenario(FS& fs, FitInfinityOfflineStore& store, Outcome& outcome) {
+    uint32_t serial = 0;
+    appendSome(fs, store, outcome, 6, serial);
+    commitTo(fs, store, outcome, 2);
+    appendSome(fs, store, outcome, 7, serial);
+    store.pack(UINT32_MAX);
+    commitTo(fs, store, outcome, 5);
+    appendSome(fs, store, outcome, 3, serial);
+    commitTo(fs, store, outcome, 9);
+    appendSome(fs, store, outcome, 2, serial);
+}
+
+// Reopens the store and checks it against what the interrupted run acknowledged
+static bool recovers(FS& fs, const Outcome& outcome, long cut) {
+    int before = testFailures;
+    FitInfinityOfflineStore store;
+    CHECK(store.begin(fs));
+
+    // A commit that returned true is durable; one that failed may or may not have landed
+    CHECK(store.head() >= outcome.committed);
+    CHECK(store.head() <= (outcome.attempted > outcome.committed ? outcome.attempted : outcome.committed));
+
+    uint32_t last = 0;
+    bool first = true;
+    std::map<uint32_t, std::string> seen;
+    FitInfinityOfflineStore::Reader reader(store);
+    OfflineRecord record;
+    while (reader.next(record)) {
+        CHECK(first || record.seq > last);
+        auto acknowledged = outcome.acknowledged.find(record.seq);
+        CHECK(acknowledged != outcome.acknowledged.end() && acknowledged->second == record.id);
+        seen[record.seq] = record.id;
+        last = record.seq;
+        first = false;
+    }
+    for (const auto& acknowledged : outcome.acknowledged) {
+        if (acknowledged.first >= store.head()) {
+            CHECK(seen.count(acknowledged.first) == 1);
+        }
+    }
+
+    // Numbering carries on past everything written before the cut
+    uint32_t highest = outcome.acknowledged.empty() ? 0 : outcome.acknowledged.rbegin()->first;
+    uint32_t seq = store.tail();
+    CHECK(outcome.acknowledged.empty() || seq > highest);
+    CHECK(store.append(OFFLINE_FINGERPRINT, "after", 1704070000));
+    store.close();
+
+    // The record written after recovery survives another restart, behind the old ones
+    FitInfinityOfflineStore reopened;
+    CHECK(reopened.begin(fs));
+    CHECK(reopened.read(seq, record) && strcmp(record.id, "after") == 0);
+    FitInfinityOfflineStore::Reader again(reopened);
+    uint32_t count = 0;
+    while (again.next(record)) {
+        count++;
+    }
+    CHECK(count == seen.size() + 1);
+
+    if (testFailures != before) {
+        printf("  with the power cut after %ld changes\n", cut);
+    }
+    return testFailures == before;
+}
+
+static void survivesPowerCutAtEveryWrite() {
+    // A clean run tells how many changes the scenario makes
+    unsigned long changes;
+    {
+        FS fs;
+        FitInfinityOfflineStore store;
+        CHECK(store.begin(fs));
+        unsigned long start = fs.operations();
+        Outcome outcome = {{}, 0, 0};
+        scenario(fs, store, outcome);
+        changes = fs.operations() - start;
+        CHECK(outcome.acknowledged.size() == 18 && outcome.committed == 9);
+    }
+    CHECK(changes > 30);
+
+    for (long cut = 0; cut <= (long)changes; cut++) {
+        FS fs;
+        Outcome outcome = {{}, 0, 0};
+        {
+            FitInfinityOfflineStore store;
+            CHECK(store.begin(fs));
+            fs.cutPowerAfter(cut);
+            scenario(fs, store, outcome);
+            CHECK(cut == (long)changes || !fs.powered());
+        }
+        fs.restorePower();
+        if (!recovers(fs, outcome, cut)) {
+            break;
+        }
+    }
+}
+
+static void cutDuringBeginLeavesAUsableStore() {
+    // Recovery itself writes (sealing a torn record, the first cursor slot)
+    for (long cut = 0; cut < 4; cut++) {
+        FS fs;
+        {
+            FitInfinityOfflineStore store;
+            CHECK(store.begin(fs));
+            CHECK(store.append(OFFLINE_RFID, "A", 1));
+            fs.cutPowerAfter(0);
+            store.append(OFFLINE_RFID, "B", 2);     // torn
+        }
+        fs.restorePower();
+        {
+            FitInfinityOfflineStore store;
+            fs.cutPowerAfter(cut);
+            store.begin(fs);
+        }
+        fs.restorePower();
+
+        FitInfinityOfflineStore store;
+        CHECK(store.begin(fs));
+        OfflineRecord record;
+        CHECK(store.read(0, record) && strcmp(record.id, "A") == 0);
+        uint32_t seq = store.tail();
+        CHECK(seq >= 1);
+        CHECK(store.append(OFFLINE_RFID, "C", 3));
+        CHECK(store.read(seq, record) && strcmp(record.id, "C") == 0);
+    }
+}
+
+static void restartFlushesEveryOpenStore() {
+    FS firstFs;
+    FS secondFs;
+    FitInfinityOfflineStore first;
+    CHECK(first.begin(firstFs));
+    CHECK(first.setMemoryTier(8, 8, 60000));
+    first.append(OFFLINE_RFID, "A", 1);
+    {
+        // A second store, like the benchmark's, must not take the first one's place
+        FitInfinityOfflineStore second;
+        CHECK(second.begin(secondFs));
+        CHECK(second.setMemoryTier(8, 8, 60000));
+        second.append(OFFLINE_RFID, "B", 2);
+
+        mockRestart();
+        CHECK(first.tail() == 1);
+        CHECK(second.tail() == 1);
+    }
+
+    // Destroying the second leaves the first registered
+    first.append(OFFLINE_RFID, "C", 3);
+    mockRestart();
+    CHECK(first.tail() == 2);
+
+    // Calling begin() again does not register a store twice
+    FS thirdFs;
+    FitInfinityOfflineStore third;
+    CHECK(third.begin(thirdFs));
+    CHECK(third.begin(thirdFs));
+    CHECK(third.setMemoryTier(8, 8, 60000));
+    third.append(OFFLINE_RFID, "D", 4);
+    first.append(OFFLINE_RFID, "E", 5);
+    mockRestart();
+    CHECK(third.tail() == 1);
+    CHECK(first.tail() == 3);
+}
+
+int main() {
+    RUN(survivesPowerCutAtEveryWrite);
+    RUN(cutDuringBeginLeavesAUsableStore);
+    RUN(restartFlushesEveryOpenStore);
+    return testResult();
+}
@@ -0,0 +1,251 @@
+#include "test.h"
+#include <FitInfinityOfflineStore.h>
+#include <esp_system.h>
+#include <vector>
+
+// Built with small segments (see the Makefile) so a few records span several files
+static_assert(OFFLINE_SEGMENT_RECORDS <= 8, "build the store tests with small segments");
+
+static const uint32_t EPOCH = 1704067200;   // 2024-01-01T00:00:00Z
+
+static void appendRecords(FitInfinityOfflineStore& store, uint32_t first, uint32_t count) {
+    char id[16];
+    for (uint32_t i = first; i < first + count; i++) {
+        snprintf(id, sizeof(id), "ID%u", (unsigned)i);
+        CHECK(store.append(i % 2 ? OFFLINE_RFID : OFFLINE_FINGERPRINT, id, EPOCH + i * 60));
+    }
+}
+
+// Every record the reader yields, with its sequence number checked against the ID
+static std::vector<uint32_t> readAll(FitInfinityOfflineStore& store) {
+    std::vector<uint32_t> seqs;
+    FitInfinityOfflineStore::Reader reader(store);
+    OfflineRecord record;
+    char id[16];
+    while (reader.next(record)) {
+        snprintf(id, sizeof(id), "ID%u", (unsigned)record.seq);
+        CHECK(strcmp(record.id, id) == 0);
+        CHECK(record.epoch == EPOCH + record.seq * 60);
+        CHECK(record.type == (record.seq % 2 ? OFFLINE_RFID : OFFLINE_FINGERPRINT));
+        seqs.push_back(record.seq);
+    }
+    return seqs;
+}
+
+static void appendsReadBackInOrder() {
+    FS fs;
+    FitInfinityOfflineStore store;
+    CHECK(store.begin(fs));
+    appendRecords(store, 0, 10);
+
+    CHECK(store.pending() == 10);
+    CHECK(store.tail() == 10);
+    CHECK(store.segmentCount() == (10 + OFFLINE_SEGMENT_RECORDS - 1) / OFFLINE_SEGMENT_RECORDS);
+    std::vector<uint32_t> seqs = readAll(store);
+    CHECK(seqs.size() == 10);
+    for (uint32_t i = 0; i < seqs.size(); i++) {
+        CHECK(seqs[i] == i);
+    }
+
+    OfflineRecord record;
+    CHECK(store.read(7, record) && strcmp(record.id, "ID7") == 0);
+    CHECK(!store.read(10, record));
+}
+
+static void commitPersistsAcrossRestart() {
+    FS fs;
+    {
+        FitInfinityOfflineStore store;
+        CHECK(store.begin(fs));
+        appendRecords(store, 0, 10);
+        CHECK(store.commit(6));
+        CHECK(store.head() == 6);
+    }
+
+    FitInfinityOfflineStore store;
+    CHECK(store.begin(fs));
+    CHECK(store.head() == 6);
+    CHECK(store.tail() == 10);
+    std::vector<uint32_t> seqs = readAll(store);
+    CHECK(seqs.size() == 4 && seqs.front() == 6);
+
+    // Oldest and newest come from the persisted index, delivered count included
+    OfflineStats stats = store.stats();
+    CHECK(stats.pending == 4);
+    CHECK(stats.oldestEpoch == EPOCH + 6 * 60);
+    CHECK(stats.newestEpoch == EPOCH + 9 * 60);
+    CHECK(stats.delivered == 6);
+
+    // Numbering continues after a fully drained log
+    CHECK(store.commit(10));
+    FitInfinityOfflineStore reopened;
+    CHECK(reopened.begin(fs));
+    CHECK(reopened.head() == 10 && reopened.tail() == 10);
+    appendRecords(reopened, 10, 1);
+    CHECK(reopened.tail() == 11);
+}
+
+static void deliveredSegmentsAreDeleted() {
+    FS fs;
+    FitInfinityOfflineStore store;
+    CHECK(store.begin(fs));
+    appendRecords(store, 0, OFFLINE_SEGMENT_RECORDS * 3);
+    CHECK(store.commit(OFFLINE_SEGMENT_RECORDS * 2));
+    CHECK(!fs.exists("/offline/00000000.seg"));
+    CHECK(!fs.exists("/offline/00000001.seg"));
+    CHECK(fs.exists("/offline/00000002.seg"));
+}
+
+static void memoryTierSpillsInBatches() {
+    FS fs;
+    FitInfinityOfflineStore store;
+    CHECK(store.begin(fs));
+    CHECK(store.setMemoryTier(8, 3, 1000));
+
+    mockMillis = 0;
+    appendRecords(store, 0, 2);
+    CHECK(store.pending() == 2);
+    CHECK(store.tail() == 0);
+    CHECK(store.stats().buffered == 2);
+
+    // The third record reaches the spill threshold
+    appendRecords(store, 2, 1);
+    CHECK(store.tail() == 3);
+    CHECK(store.stats().buffered == 0);
+
+    // One record waits for the delay instead
+    appendRecords(store, 3, 1);
+    mockMillis += 999;
+    store.maintain();
+    CHECK(store.tail() == 3);
+    mockMillis += 1;
+    store.maintain();
+    CHECK(store.tail() == 4);
+    CHECK(readAll(store).size() == 4);
+}
+
+static void shutdownFlushesBufferedRecords() {
+    FS fs;
+    FitInfinityOfflineStore store;
+    CHECK(store.begin(fs));
+    CHECK(store.setMemoryTier(8, 8, 60000));
+    appendRecords(store, 0, 5);
+    CHECK(store.tail() == 0);
+
+    mockRestart();
+    CHECK(store.tail() == 5);
+}
+
+static void packedSegmentsReadTheSame() {
+    FS fs;
+    FitInfinityOfflineStore store;
+    CHECK(store.begin(fs));
+    store.setPacking(false);
+    appendRecords(store, 0, OFFLINE_SEGMENT_RECORDS * 4 + 1);
+    uint32_t plainBytes = store.stats().bytes;
+
+    // The segment at the cursor and the one being written stay plain
+    CHECK(store.pack(UINT32_MAX) == 3);
+    CHECK(store.stats().bytes < plainBytes);
+    std::vector<uint32_t> seqs = readAll(store);
+    CHECK(seqs.size() == OFFLINE_SEGMENT_RECORDS * 4 + 1);
+
+    // Random access and resuming a reader inside a packed segment
+    OfflineRecord record;
+    CHECK(store.read(OFFLINE_SEGMENT_RECORDS + 2, record) && record.seq == OFFLINE_SEGMENT_RECORDS + 2);
+    FitInfinityOfflineStore::Reader reader(store, OFFLINE_SEGMENT_RECORDS * 2 + 1);
+    CHECK(reader.next(record) && record.seq == OFFLINE_SEGMENT_RECORDS * 2 + 1);
+
+    // Still readable after a restart, and deleted once delivered
+    FitInfinityOfflineStore reopened;
+    CHECK(reopened.begin(fs));
+    CHECK(readAll(reopened).size() == seqs.size());
+    CHECK(reopened.commit(OFFLINE_SEGMENT_RECORDS * 4));
+    CHECK(fs.list("/offline").size() == 3);     // last segment plus two cursor slots
+}
+
+static void damagedRecordIsSkipped() {
+    FS fs;
+    FitInfinityOfflineStore store;
+    CHECK(store.begin(fs));
+    appendRecords(store, 0, 3);
+    store.close();
+
+    // Flip one byte of the middle record's ID
+    std::vector<uint8_t>* segment = fs.contents("/offline/00000000.seg");
+    CHECK(segment != nullptr);
+    size_t recordSize = (segment->size() - 16) / 3;
+    (*segment)[16 + recordSize + 10] ^= 0xff;
+
+    std::vector<uint32_t> seqs = readAll(store);
+    CHECK(seqs.size() == 2 && seqs[0] == 0 && seqs[1] == 2);
+    CHECK(store.corrupted() == 1);
+}
+
+static void tornTailIsSealedOnBegin() {
+    FS fs;
+    {
+        FitInfinityOfflineStore store;
+        CHECK(store.begin(fs));
+        appendRecords(store, 0, 3);
+    }
+
+    // A power cut halfway through the fourth record
+    std::vector<uint8_t>* segment = fs.contents("/offline/00000000.seg");
+    size_t recordSize = (segment->size() - 16) / 3;
+    segment->resize(segment->size() + recordSize / 2, 0x5a);
+
+    FitInfinityOfflineStore store;
+    CHECK(store.begin(fs));
+    CHECK(store.tail() == 4);                   // the torn slot keeps its number
+    CHECK((segment->size() - 16) % recordSize == 0);
+    appendRecords(store, 4, 1);
+    std::vector<uint32_t> seqs = readAll(store);
+    CHECK(seqs.size() == 4 && seqs.back() == 4);
+    CHECK(store.corrupted() >= 1);
+}
+
+static void statsDoNotChangeTheStore() {
+    FS fs;
+    FitInfinityOfflineStore store;
+    CHECK(store.begin(fs));
+    appendRecords(store, 0, 5);
+
+    mockMillis = 0;
+    CHECK(store.commit(2));
+    mockMillis = 60000;
+    OfflineStats before = store.stats();
+    OfflineStats after = store.stats();
+    CHECK(memcmp(&before, &after, sizeof(before)) == 0);
+    CHECK(before.drainRate == 0);
+
+    // The window is rolled over by the owner of the store
+    store.maintain();
+    CHECK(store.stats().drainRate == 2);
+}
+
+static void timestampsRoundTrip() {
+    CHECK(FitInfinityOfflineStore::parseTimestamp("2024-01-01T00:00:00.000Z") == EPOCH);
+    CHECK(FitInfinityOfflineStore::parseTimestamp("2024-02-29T12:34:56.000Z") == 1709210096);
+    CHECK(FitInfinityOfflineStore::parseTimestamp("not a time") == 0);
+
+    char buffer[32];
+    FitInfinityOfflineStore::formatTimestamp(1709210096, buffer, sizeof(buffer));
+    CHECK(strcmp(buffer, "2024-02-29T12:34:56.000Z") == 0);
+    FitInfinityOfflineStore::formatTimestamp(0, buffer, sizeof(buffer));
+    CHECK(buffer[0] == '\0');
+}
+
+int main() {
+    RUN(appendsReadBackInOrder);
+    RUN(commitPersistsAcrossRestart);
+    RUN(deliveredSegmentsAreDeleted);
+    RUN(memoryTierSpillsInBatches);
+    RUN(shutdownFlushesBufferedRecords);
+    RUN(packedSegmentsReadTheSame);
+    RUN(damagedRecordIsSkipped);
+    RUN(tornTailIsSealedOnBegin);
+    RUN(statsDoNotChangeTheStore);
+    RUN(timestampsRoundTrip);
+    return testResult();
+}
@@ -0,0 +1,91 @@
+#include "test.h"
+#include <FitInfinityRing.h>
+#include <thread>
+
+static void pushAndPopInOrder() {
+    FitInfinityRing<int, 4> ring;
+    CHECK(ring.front() == nullptr);
+    CHECK(ring.size() == 0);
+
+    for (int i = 0; i < 4; i++) {
+        CHECK(ring.push(i));
+    }
+    CHECK(ring.size() == 4);
+    CHECK(!ring.push(4));
+    CHECK(ring.reserve() == nullptr);
+
+    for (int i = 0; i < 4; i++) {
+        int* item = ring.front();
+        CHECK(item && *item == i);
+        ring.pop();
+    }
+    CHECK(ring.front() == nullptr);
+}
+
+static void reserveFillsInPlace() {
+    FitInfinityRing<int, 2> ring;
+    int* slot = ring.reserve();
+    CHECK(slot != nullptr);
+    *slot = 7;
+    // Nothing is visible before commit()
+    CHECK(ring.front() == nullptr);
+    ring.commit();
+    CHECK(ring.front() && *ring.front() == 7);
+}
+
+static void wrapsAroundManyTimes() {
+    FitInfinityRing<uint32_t, 8> ring;
+    uint32_t next = 0;
+    for (uint32_t i = 0; i < 1000; i++) {
+        CHECK(ring.push(i));
+        // Let the fill level wander so head and tail wrap at different points
+        while (ring.size() > i % 7) {
+            CHECK(*ring.front() == next);
+            ring.pop();
+            next++;
+        }
+    }
+    while (ring.front()) {
+        CHECK(*ring.front() == next);
+        ring.pop();
+        next++;
+    }
+    CHECK(next == 1000);
+}
+
+static void producerAndConsumerThreads() {
+    // The two-task case the ring exists for: nothing lost, nothing reordered
+    static FitInfinityRing<uint32_t, 16> ring;
+    const uint32_t count = 200000;
+    std::thread producer([&]() {
+        for (uint32_t i = 0; i < count; i++) {
+            while (!ring.push(i)) {
+                std::this_thread::yield();
+            }
+        }
+    });
+
+    uint32_t expected = 0;
+    bool ordered = true;
+    while (expected < count) {
+        uint32_t* item = ring.front();
+        if (!item) {
+            std::this_thread::yield();
+            continue;
+        }
+        ordered = ordered && *item == expected;
+        ring.pop();
+        expected++;
+    }
+    producer.join();
+    CHECK(ordered);
+    CHECK(ring.size() == 0);
+}
+
+int main() {
+    RUN(pushAndPopInOrder);
+    RUN(reserveFillsInPlace);
+    RUN(wrapsAroundManyTimes);
+    RUN(producerAndConsumerThreads);
+    return testResult();
+}
@@ -0,0 +1,87 @@
+#include "test.h"
+#include <FitInfinityScanFilter.h>
+
+static void repeatInsideWindowIsRefused() {
+    FitInfinityScanFilter<4> filter(10000);
+    CHECK(!filter.isRepeat("rfid", "A1", 0));
+    filter.record("rfid", "A1", 0);
+
+    CHECK(filter.isRepeat("rfid", "A1", 5000));
+    CHECK(filter.suppressed() == 1);
+
+    // The sighting at 5 s restarted the window
+    CHECK(filter.isRepeat("rfid", "A1", 14000));
+    CHECK(!filter.isRepeat("rfid", "A1", 24000));
+    CHECK(filter.suppressed() == 2);
+}
+
+static void onlyRecordedScansCount() {
+    // A scan that was never logged or stored must not block the retry
+    FitInfinityScanFilter<4> filter(10000);
+    CHECK(!filter.isRepeat("fingerprint", "3", 0));
+    CHECK(!filter.isRepeat("fingerprint", "3", 100));
+    CHECK(filter.suppressed() == 0);
+}
+
+static void typeAndIdAreBothPartOfTheKey() {
+    FitInfinityScanFilter<4> filter(10000);
+    filter.record("rfid", "12", 0);
+    CHECK(!filter.isRepeat("fingerprint", "12", 1));
+    CHECK(!filter.isRepeat("rfid", "1", 1));
+    CHECK(!filter.isRepeat("rfid", "123", 1));
+    CHECK(filter.isRepeat("rfid", "12", 1));
+}
+
+static void leastRecentlySeenIsEvicted() {
+    FitInfinityScanFilter<2> filter(10000);
+    filter.record("rfid", "A", 0);
+    filter.record("rfid", "B", 10);
+    CHECK(filter.isRepeat("rfid", "A", 20));    // A is now the most recently seen
+    filter.record("rfid", "C", 30);             // evicts B
+
+    CHECK(filter.isRepeat("rfid", "A", 40));
+    CHECK(filter.isRepeat("rfid", "C", 40));
+    CHECK(!filter.isRepeat("rfid", "B", 40));
+}
+
+static void forgottenScanIsNotARepeat() {
+    // An async scan is marked while in flight and dropped again if it fails
+    FitInfinityScanFilter<4> filter(10000);
+    filter.record("rfid", "A", 0);
+    filter.record("rfid", "B", 0);
+    CHECK(filter.isRepeat("rfid", "A", 100));
+    filter.forget("rfid", "A");
+    CHECK(!filter.isRepeat("rfid", "A", 200));
+    CHECK(filter.isRepeat("rfid", "B", 200));
+    filter.forget("rfid", "C");                 // never recorded
+    CHECK(filter.isRepeat("rfid", "B", 300));
+}
+
+static void zeroWindowDisables() {
+    FitInfinityScanFilter<2> filter(0);
+    filter.record("rfid", "A", 0);
+    CHECK(!filter.isRepeat("rfid", "A", 0));
+
+    filter.setWindow(1000);
+    filter.record("rfid", "A", 0);
+    CHECK(filter.isRepeat("rfid", "A", 999));
+}
+
+static void survivesClockWrap() {
+    FitInfinityScanFilter<2> filter(10000);
+    unsigned long nearWrap = (unsigned long)-5000;
+    filter.record("rfid", "A", nearWrap);
+    CHECK(filter.isRepeat("rfid", "A", nearWrap + 4000));
+    CHECK(!filter.isRepeat("rfid", "A", nearWrap + 4000 + 10000));
+}
+
+int main() {
+    RUN(repeatInsideWindowIsRefused);
+    RUN(onlyRecordedScansCount);
+    RUN(typeAndIdAreBothPartOfTheKey);
+    RUN(leastRecentlySeenIsEvicted);
+    RUN(forgottenScanIsNotARepeat);
+    RUN(zeroWindowDisables);
+    RUN(survivesClockWrap);
+    return testResult();
+}